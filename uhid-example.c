@@ -18,30 +18,80 @@
  *
  * The program will:
  * - Convert ASCII characters to HID key codes
- * - Handle modifier keys (Shift for uppercase letters)
+ * - Handle modifier keys (Shift for uppercase letters and shifted symbols)
  * - Send key press and release events for each character
  * - Support letters, numbers, and common special characters
  *
  * If uhid is not available as /dev/uhid, then you can pass a different path as
  * first argument.
  * If <linux/uhid.h> is not installed in /usr, then compile this with:
- *   gcc -o ./uhid_test -Wall -I./include ./samples/uhid/uhid-example.c
+ *   gcc -o ./uhid_test -Wall -pthread -I./include ./samples/uhid/uhid-example.c
  * And ignore the warning about kernel headers. However, it is recommended to
  * use the installed uhid.h if available.
+ * Add -DUHID_IO_URING to run the main loop on io_uring (Linux 5.6 or later,
+ * no liburing needed); it falls back to epoll where io_uring is unavailable.
+ * Bulk text is scanned with SSE2 on x86-64 and NEON on arm64; add -mavx2
+ * (or -march=native) for AVX2.
+ * With -DUHID_KBD_LIB this builds the library of uhid-kbd.h instead of the
+ * program: gcc -c -O2 -pthread -DUHID_KBD_LIB -o uhid-kbd.o uhid-example.c
+ * With -DUHID_FUZZ it builds a libFuzzer target for the input parser:
+ *   clang -g -O1 -fsanitize=fuzzer,address -pthread -DUHID_FUZZ uhid-example.c
  */
 
+#define _GNU_SOURCE	/* accept4(), pthread_attr_setaffinity_np() */
+
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <netdb.h>
 #include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/input.h>
 #include <linux/uhid.h>
+#ifdef UHID_FUZZ
+#define UHID_KBD_LIB	/* libFuzzer brings its own main() */
+#endif
+#ifdef UHID_KBD_LIB
+#undef UHID_IO_URING	/* the caller runs the loop, see uhid-kbd.h */
+#endif
+#ifdef UHID_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "uhid-kbd.h"
 
 /* ===== Minimal hygiene / constants ===== */
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define HID_MOD_LSHIFT 0x02
 
 /* Common HID key codes we use */
@@ -66,12 +116,267 @@
 #define HID_KEY_DOWN  0x51
 #define HID_KEY_UP    0x52
 
-/* Helpers */
-#define IS_UPPER_ALPHA(c) ((c) >= 'A' && (c) <= 'Z')
-#define IS_LOWER_ALPHA(c) ((c) >= 'a' && (c) <= 'z')
-#define IS_DIGIT(c)       ((c) >= '0' && (c) <= '9')
+/* Navigation and function keys (usage page 0x07) */
+#define HID_KEY_F1       0x3a	/* F1..F12 are consecutive */
+#define HID_KEY_INSERT   0x49
+#define HID_KEY_HOME     0x4a
+#define HID_KEY_PAGEUP   0x4b
+#define HID_KEY_DELETE   0x4c
+#define HID_KEY_END      0x4d
+#define HID_KEY_PAGEDOWN 0x4e
+
+#define HID_MOD_LCTRL 0x01
+#define HID_MOD_LALT  0x04
+#define HID_MOD_LGUI  0x08
+#define HID_MOD_RALT  0x40	/* AltGr */
+
+/*
+ * Consumer page (0x0c) usages we have names for: the single list from
+ * which both the CC_* constants and the name table of the consumer
+ * command are generated. Any other usage up to 0x3ff can still be sent
+ * by number.
+ */
+#define CONSUMER_USAGES(X)			\
+	X(POWER,		"power",	0x030)	\
+	X(SLEEP,		"sleep",	0x032)	\
+	X(MENU,			"menu",		0x040)	\
+	X(MENU_PICK,		"select",	0x041)	\
+	X(MENU_UP,		"menuup",	0x042)	\
+	X(MENU_DOWN,		"menudown",	0x043)	\
+	X(MENU_LEFT,		"menuleft",	0x044)	\
+	X(MENU_RIGHT,		"menuright",	0x045)	\
+	X(MENU_ESCAPE,		"menuesc",	0x046)	\
+	X(INFO,			"info",		0x060)	\
+	X(BRIGHTNESS_UP,	"brightnessup",	0x06f)	\
+	X(BRIGHTNESS_DOWN,	"brightnessdown", 0x070) \
+	X(GUIDE,		"guide",	0x08d)	\
+	X(CHANNEL_UP,		"channelup",	0x09c)	\
+	X(CHANNEL_DOWN,		"channeldown",	0x09d)	\
+	X(PLAY,			"play",		0x0b0)	\
+	X(PAUSE,		"pause",	0x0b1)	\
+	X(RECORD,		"record",	0x0b2)	\
+	X(FAST_FORWARD,		"forward",	0x0b3)	\
+	X(REWIND,		"rewind",	0x0b4)	\
+	X(NEXT_TRACK,		"next",		0x0b5)	\
+	X(PREV_TRACK,		"prev",		0x0b6)	\
+	X(STOP,			"stop",		0x0b7)	\
+	X(EJECT,		"eject",	0x0b8)	\
+	X(PLAY_PAUSE,		"playpause",	0x0cd)	\
+	X(MUTE,			"mute",		0x0e2)	\
+	X(VOLUME_UP,		"volup",	0x0e9)	\
+	X(VOLUME_DOWN,		"voldown",	0x0ea)	\
+	X(MAIL,			"mail",		0x18a)	\
+	X(CALCULATOR,		"calculator",	0x192)	\
+	X(BROWSER,		"browser",	0x196)	\
+	X(AC_SEARCH,		"search",	0x221)	\
+	X(AC_HOME,		"home",		0x223)	\
+	X(AC_BACK,		"back",		0x224)	\
+	X(AC_FORWARD,		"acforward",	0x225)	\
+	X(AC_REFRESH,		"refresh",	0x227)
+
+#define CONSUMER_ENUM(id, name, usage) CC_##id = usage,
+enum consumer_usage { CONSUMER_USAGES(CONSUMER_ENUM) };
+#define CONSUMER_USAGE_MAX 0x3ff
+
+/*
+ * Diagnostics
+ * Messages are formatted straight into a slot of a bounded lock-free ring
+ * (Vyukov-style, safe for any number of producers) and written to stderr
+ * later by log_drain(), which main() calls whenever poll() finds nothing
+ * else to do. A stalled console thus no longer stalls report injection.
+ * Each level is checked before any formatting happens, messages beyond
+ * g_log_rate per second are discarded, and so are messages that find the
+ * ring full; the number discarded is reported by the next drain. Errors
+ * additionally try to drain right away so they are not held back.
+ */
+enum log_level {
+	LVL_ERROR,
+	LVL_WARN,
+	LVL_INFO,
+	LVL_DEBUG,
+};
+
+#define LOG_RING_SIZE 512	/* power of two */
+#define LOG_MSG_MAX 160
+
+struct log_slot {
+	atomic_size_t seq;
+	unsigned short len;
+	char text[LOG_MSG_MAX];
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int g_log_level = LVL_DEBUG;	/* gated later via env */
+static unsigned int g_log_rate = 1000;	/* messages per second, 0 = unlimited */
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static atomic_size_t log_head;		/* next slot to reserve */
+static atomic_size_t log_tail;		/* next slot to drain */
+static atomic_ulong log_dropped;
+static atomic_flag log_draining = ATOMIC_FLAG_INIT;
+static atomic_long log_window;		/* second the rate counter refers to */
+static atomic_uint log_window_count;
+
+static void log_drain(void);
+
+static void log_init(void)
+{
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+		atomic_init(&log_ring[i].seq, i);
+}
+
+static bool log_pending(void)
+{
+	return atomic_load_explicit(&log_head, memory_order_relaxed) !=
+	       atomic_load_explicit(&log_tail, memory_order_relaxed);
+}
+
+static bool log_rate_ok(void)
+{
+	struct timespec now;
+	long window;
+
+	if (!g_log_rate)
+		return true;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	window = atomic_load_explicit(&log_window, memory_order_relaxed);
+	if (window != now.tv_sec &&
+	    atomic_compare_exchange_strong(&log_window, &window, now.tv_sec))
+		atomic_store_explicit(&log_window_count, 0, memory_order_relaxed);
+	return atomic_fetch_add_explicit(&log_window_count, 1, memory_order_relaxed) < g_log_rate;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void log_msg(int level, const char *fmt, ...)
+{
+	int saved_errno = errno;
+	struct log_slot *slot;
+	size_t pos, seq;
+	va_list ap;
+	int len;
+
+	if (level > LVL_ERROR && !log_rate_ok())
+		goto drop;
+
+	pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+	for (;;) {
+		slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if ((ssize_t)(seq - pos) < 0) {
+			goto drop;	/* ring full */
+		} else {
+			pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+		}
+	}
+
+	errno = saved_errno;
+	va_start(ap, fmt);
+	len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		len = 0;
+	else if (len >= LOG_MSG_MAX)
+		len = LOG_MSG_MAX - 1;
+	slot->len = len;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	if (level == LVL_ERROR)
+		log_drain();
+	errno = saved_errno;
+	return;
+
+drop:
+	atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+	errno = saved_errno;
+}
+
+#define log_at(level, ...)					\
+	do {							\
+		if (g_log_level >= (level))			\
+			log_msg((level), __VA_ARGS__);		\
+	} while (0)
+#define log_error(...) log_at(LVL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LVL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LVL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LVL_DEBUG, __VA_ARGS__)
+
+static void log_write(const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(STDERR_FILENO, buf, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/* Write all published messages to stderr; a single consumer at a time */
+static void log_drain(void)
+{
+	int saved_errno = errno;
+	char out[4096];
+	size_t used = 0, tail;
+	unsigned long dropped;
+
+	if (atomic_flag_test_and_set_explicit(&log_draining, memory_order_acquire))
+		return;
+
+	tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+	for (;;) {
+		struct log_slot *slot = &log_ring[tail & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq != tail + 1)
+			break;
+		if (used + slot->len > sizeof(out)) {
+			log_write(out, used);
+			used = 0;
+		}
+		memcpy(out + used, slot->text, slot->len);
+		used += slot->len;
+		atomic_store_explicit(&slot->seq, tail + LOG_RING_SIZE, memory_order_release);
+		atomic_store_explicit(&log_tail, ++tail, memory_order_relaxed);
+	}
+	dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+	if (dropped) {
+		if (used + 64 > sizeof(out)) {
+			log_write(out, used);
+			used = 0;
+		}
+		used += snprintf(out + used, 64, "(%lu log messages dropped)\n", dropped);
+	}
+	log_write(out, used);
+
+	atomic_flag_clear_explicit(&log_draining, memory_order_release);
+	errno = saved_errno;
+}
+
+static int log_level_from_str(const char *str)
+{
+	static const char *const names[] = { "error", "warn", "info", "debug" };
 
-static int g_verbose = 1; /* gated later via env */
+	for (int i = 0; i <= LVL_DEBUG; i++)
+		if (!strcasecmp(str, names[i]))
+			return i;
+	return -1;
+}
+static int g_batch = 1;   /* queue reports and flush them with writev() */
 
 /*
  * HID Report Descriptor
@@ -115,6 +420,21 @@ static int g_verbose = 1; /* gated later via env */
  *     Report Count(6)
  *     Report Offset(16)
  *     Flags( Variable Absolute )
+ * OUTPUT(1)[OUTPUT]
+ *   Field(0)
+ *     Application(GenericDesktop.Keyboard)
+ *     Usage(5)
+ *       LED.NumLock
+ *       LED.CapsLock
+ *       LED.ScrollLock
+ *       LED.Compose
+ *       LED.Kana
+ *     Logical Minimum(0)
+ *     Logical Maximum(1)
+ *     Report Size(1)
+ *     Report Count(5)
+ *     Report Offset(0)
+ *     Flags( Variable Absolute )
  *
  * This is the mapping that we expect:
  *   Keyboard.LeftControl ---> Key.LeftControl
@@ -126,6 +446,11 @@ static int g_verbose = 1; /* gated later via env */
  *   Keyboard.RightAlt ---> Key.RightAlt
  *   Keyboard.RightGUI ---> Key.RightGUI
  *   Keyboard.Keypad ---> Key.Keypad
+ *   LED.NumLock ---> LED.NumLock
+ *   LED.CapsLock ---> LED.CapsLock
+ *   LED.ScrollLock ---> LED.ScrollLock
+ *   LED.Compose ---> LED.Compose
+ *   LED.Kana ---> LED.Kana
  *
  * This information can be verified by reading /sys/kernel/debug/hid/<dev>/rdesc
  * This file should print the same information as showed above.
@@ -147,6 +472,15 @@ static unsigned char rdesc[] = {
 	0x95, 0x01,		/* REPORT_COUNT (1) */
 	0x75, 0x08,		/* REPORT_SIZE (8) */
 	0x81, 0x01,		/* INPUT (Cnst,Var,Abs) */
+	0x95, 0x05,		/* REPORT_COUNT (5) */
+	0x75, 0x01,		/* REPORT_SIZE (1) */
+	0x05, 0x08,		/* USAGE_PAGE (LEDs) */
+	0x19, 0x01,		/* USAGE_MINIMUM (Num Lock) */
+	0x29, 0x05,		/* USAGE_MAXIMUM (Kana) */
+	0x91, 0x02,		/* OUTPUT (Data,Var,Abs) */
+	0x95, 0x01,		/* REPORT_COUNT (1) */
+	0x75, 0x03,		/* REPORT_SIZE (3) */
+	0x91, 0x01,		/* OUTPUT (Cnst,Var,Abs) */
 	0x95, 0x06,		/* REPORT_COUNT (6) */
 	0x75, 0x08,		/* REPORT_SIZE (8) */
 	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
@@ -157,524 +491,6712 @@ static unsigned char rdesc[] = {
 	0x81, 0x00,		/* INPUT (Data,Array,Abs) */
 	0xc0,		/* END_COLLECTION */
 
-	/* Consumer Control for Volume Up/Down (1-byte report) */
+	/* Consumer Control: one 16-bit usage, 0 = none (2-byte report) */
 	0x05, 0x0c,		/* USAGE_PAGE (Consumer) */
 	0x09, 0x01,		/* USAGE (Consumer Control) */
 	0xa1, 0x01,		/* COLLECTION (Application) */
 	0x85, 0x02,		/* REPORT_ID (2) - Consumer */
 	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
+	0x26, 0xff, 0x03,	/* LOGICAL_MAXIMUM (0x3ff) */
+	0x19, 0x00,		/* USAGE_MINIMUM (Unassigned) */
+	0x2a, 0xff, 0x03,	/* USAGE_MAXIMUM (0x3ff) */
+	0x75, 0x10,		/* REPORT_SIZE (16) */
+	0x95, 0x01,		/* REPORT_COUNT (1) */
+	0x81, 0x00,		/* INPUT (Data,Array,Abs) */
+	0xc0,			/* END_COLLECTION */
+};
+
+/*
+ * N-key rollover (--nkro)
+ * Appended to rdesc[] for NKRO devices: report ID 3 carries the modifiers
+ * and one bit per keyboard usage 0x00-0xdf, so any number of keys can be
+ * down at once. Report ID 1 stays for hosts that only parse boot-style
+ * arrays, but an NKRO device only ever sends report ID 3.
+ */
+#define NKRO_BITMAP_BYTES 28	/* usages 0x00-0xdf */
+
+static unsigned char rdesc_nkro[] = {
+	0x05, 0x01,	/* USAGE_PAGE (Generic Desktop) */
+	0x09, 0x06,	/* USAGE (Keyboard) */
+	0xa1, 0x01,	/* COLLECTION (Application) */
+	0x85, 0x03,		/* REPORT_ID (3) - NKRO keyboard */
+	0x05, 0x07,		/* USAGE_PAGE (Keyboard) */
+	0x19, 0xe0,		/* USAGE_MINIMUM (Keyboard LeftControl) */
+	0x29, 0xe7,		/* USAGE_MAXIMUM (Keyboard Right GUI) */
+	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
+	0x25, 0x01,		/* LOGICAL_MAXIMUM (1) */
+	0x75, 0x01,		/* REPORT_SIZE (1) */
+	0x95, 0x08,		/* REPORT_COUNT (8) */
+	0x81, 0x02,		/* INPUT (Data,Var,Abs) */
+	0x19, 0x00,		/* USAGE_MINIMUM (Reserved) */
+	0x29, 0xdf,		/* USAGE_MAXIMUM (0xdf) */
+	0x95, 0xe0,		/* REPORT_COUNT (224) */
+	0x81, 0x02,		/* INPUT (Data,Var,Abs) */
+	0xc0,		/* END_COLLECTION */
+};
+
+/*
+ * Pointer (--pointer)
+ * Appended to rdesc[], after rdesc_nkro[] if that is there as well: report
+ * ID 4 is a five-button mouse with 16-bit relative X/Y, a wheel and AC Pan,
+ * report ID 5 the same buttons with an absolute position from 0,0 at the
+ * top left to POINTER_ABS_MAX at the bottom right of the screen, the way VM
+ * tablets do it. One device thus drives keyboard and pointer UIs alike.
+ */
+#define POINTER_ABS_MAX 32767
+
+static unsigned char rdesc_pointer[] = {
+	/* Mouse: 5 buttons, X/Y, wheel and pan (7-byte report) */
+	0x05, 0x01,	/* USAGE_PAGE (Generic Desktop) */
+	0x09, 0x02,	/* USAGE (Mouse) */
+	0xa1, 0x01,	/* COLLECTION (Application) */
+	0x85, 0x04,		/* REPORT_ID (4) - Mouse */
+	0x09, 0x01,		/* USAGE (Pointer) */
+	0xa1, 0x00,		/* COLLECTION (Physical) */
+	0x05, 0x09,		/* USAGE_PAGE (Button) */
+	0x19, 0x01,		/* USAGE_MINIMUM (Button 1) */
+	0x29, 0x05,		/* USAGE_MAXIMUM (Button 5) */
+	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
+	0x25, 0x01,		/* LOGICAL_MAXIMUM (1) */
+	0x75, 0x01,		/* REPORT_SIZE (1) */
+	0x95, 0x05,		/* REPORT_COUNT (5) */
+	0x81, 0x02,		/* INPUT (Data,Var,Abs) */
+	0x95, 0x03,		/* REPORT_COUNT (3) */
+	0x81, 0x01,		/* INPUT (Cnst) */
+	0x05, 0x01,		/* USAGE_PAGE (Generic Desktop) */
+	0x09, 0x30,		/* USAGE (X) */
+	0x09, 0x31,		/* USAGE (Y) */
+	0x16, 0x01, 0x80,	/* LOGICAL_MINIMUM (-32767) */
+	0x26, 0xff, 0x7f,	/* LOGICAL_MAXIMUM (32767) */
+	0x75, 0x10,		/* REPORT_SIZE (16) */
+	0x95, 0x02,		/* REPORT_COUNT (2) */
+	0x81, 0x06,		/* INPUT (Data,Var,Rel) */
+	0x09, 0x38,		/* USAGE (Wheel) */
+	0x15, 0x81,		/* LOGICAL_MINIMUM (-127) */
+	0x25, 0x7f,		/* LOGICAL_MAXIMUM (127) */
+	0x75, 0x08,		/* REPORT_SIZE (8) */
+	0x95, 0x01,		/* REPORT_COUNT (1) */
+	0x81, 0x06,		/* INPUT (Data,Var,Rel) */
+	0x05, 0x0c,		/* USAGE_PAGE (Consumer) */
+	0x0a, 0x38, 0x02,	/* USAGE (AC Pan) */
+	0x81, 0x06,		/* INPUT (Data,Var,Rel) */
+	0xc0,			/* END_COLLECTION */
+	0xc0,		/* END_COLLECTION */
+
+	/* Absolute pointer: 5 buttons, X/Y (5-byte report) */
+	0x05, 0x01,	/* USAGE_PAGE (Generic Desktop) */
+	0x09, 0x02,	/* USAGE (Mouse) */
+	0xa1, 0x01,	/* COLLECTION (Application) */
+	0x85, 0x05,		/* REPORT_ID (5) - Absolute pointer */
+	0x09, 0x01,		/* USAGE (Pointer) */
+	0xa1, 0x00,		/* COLLECTION (Physical) */
+	0x05, 0x09,		/* USAGE_PAGE (Button) */
+	0x19, 0x01,		/* USAGE_MINIMUM (Button 1) */
+	0x29, 0x05,		/* USAGE_MAXIMUM (Button 5) */
+	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
 	0x25, 0x01,		/* LOGICAL_MAXIMUM (1) */
-	0x09, 0xe9,		/* USAGE (Volume Increment) */
-	0x09, 0xea,		/* USAGE (Volume Decrement) */
-	0x09, 0xcd,		/* USAGE (Play/Pause) */
 	0x75, 0x01,		/* REPORT_SIZE (1) */
+	0x95, 0x05,		/* REPORT_COUNT (5) */
+	0x81, 0x02,		/* INPUT (Data,Var,Abs) */
 	0x95, 0x03,		/* REPORT_COUNT (3) */
+	0x81, 0x01,		/* INPUT (Cnst) */
+	0x05, 0x01,		/* USAGE_PAGE (Generic Desktop) */
+	0x09, 0x30,		/* USAGE (X) */
+	0x09, 0x31,		/* USAGE (Y) */
+	0x15, 0x00,		/* LOGICAL_MINIMUM (0) */
+	0x26, 0xff, 0x7f,	/* LOGICAL_MAXIMUM (32767) */
+	0x75, 0x10,		/* REPORT_SIZE (16) */
+	0x95, 0x02,		/* REPORT_COUNT (2) */
 	0x81, 0x02,		/* INPUT (Data,Var,Abs) */
-	0x95, 0x05,		/* REPORT_COUNT (5) - padding */
-	0x81, 0x01,		/* INPUT (Cnst,Array,Abs) */
 	0xc0,			/* END_COLLECTION */
+	0xc0,		/* END_COLLECTION */
 };
 
-static int uhid_write(int fd, const struct uhid_event *ev)
+static int uhid_write(int fd, const void *ev, size_t len)
 {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
 	ssize_t ret;
 
-	ret = write(fd, ev, sizeof(*ev));
+	/* Control events are rare enough to simply wait on a --nonblock fd */
+	while ((ret = write(fd, ev, len)) < 0 && (errno == EAGAIN || errno == EINTR))
+		poll(&pfd, 1, -1);
 	if (ret < 0) {
-		fprintf(stderr, "Cannot write to uhid: %m\n");
+		log_error("Cannot write to uhid: %m\n");
 		return -errno;
-	} else if (ret != sizeof(*ev)) {
-		fprintf(stderr, "Wrong size written to uhid: %zd != %zu\n",
-			ret, sizeof(ev));
+	} else if (ret != (ssize_t)len) {
+		log_error("Wrong size written to uhid: %zd != %zu\n",
+			ret, len);
 		return -EFAULT;
 	} else {
 		return 0;
 	}
 }
 
-static int create(int fd)
-{
-	struct uhid_event ev;
+/*
+ * Input reports
+ * A struct uhid_report is the wire prefix of a UHID_INPUT2 struct uhid_event
+ * (type, size, data) sized so that one report fills one cache line. The
+ * kernel zero-extends short writes, so only UHID_REPORT_LEN() bytes of it
+ * are ever written.
+ *
+ * Every device has a preinitialized, cache-aligned template for report ID 1
+ * (keyboard) and 2 (consumer); only the modifier byte, the six keycodes or
+ * the consumer usage change per send, nothing is zeroed on the hot path.
+ */
+#define UHID_REPORT_MAX 58
+#define REPORT_ID_COUNT 6	/* input report IDs 1-5, 0 is never used */
+#define REPORT_ID_MOUSE 4	/* relative, see "Pointer" below */
+#define REPORT_ID_ABS 5
+#define UHID_REPORT_LEN(rep) (offsetof(struct uhid_report, data) + (rep)->size)
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = UHID_CREATE;
-	strcpy((char*)ev.u.create.name, "test-uhid-device");
-	ev.u.create.rd_data = rdesc;
-	ev.u.create.rd_size = sizeof(rdesc);
-	ev.u.create.bus = BUS_USB;
-	ev.u.create.vendor = 0x15d9;
-	ev.u.create.product = 0x0a37;
-	ev.u.create.version = 0;
-	ev.u.create.country = 0;
+struct uhid_report {
+	__u32 type;
+	__u16 size;
+	__u8 data[UHID_REPORT_MAX];
+} __attribute__((__packed__));
 
-	return uhid_write(fd, &ev);
-}
+_Static_assert(offsetof(struct uhid_report, size) == offsetof(struct uhid_event, u.input2.size) &&
+	       offsetof(struct uhid_report, data) == offsetof(struct uhid_event, u.input2.data),
+	       "struct uhid_report must match the UHID_INPUT2 layout");
 
-static void destroy(int fd)
+/* Relative mouse reports: X, Y (le16), wheel and pan after ID and buttons */
+static inline int mouse_axis(const struct uhid_report *rep, int i)
 {
-	struct uhid_event ev;
-
-	memset(&ev, 0, sizeof(ev));
-	ev.type = UHID_DESTROY;
-
-	uhid_write(fd, &ev);
+	return i < 2 ? (__s16)(rep->data[2 + 2 * i] | rep->data[3 + 2 * i] << 8) :
+		       (__s8)rep->data[4 + i];
 }
 
-/* This parses raw output reports sent by the kernel to the device. A normal
- * uhid program shouldn't do this but instead just forward the raw report.
- * However, for ducomentational purposes, we try to detect LED events here and
- * print debug messages for it. */
-static void handle_output(struct uhid_event *ev)
+static inline void mouse_axis_set(struct uhid_report *rep, int i, int v)
 {
-	/* LED messages are adverised via OUTPUT reports; ignore the rest */
-	if (ev->u.output.rtype != UHID_OUTPUT_REPORT)
-		return;
-	/* LED reports have length 2 bytes */
-	if (ev->u.output.size != 2)
-		return;
-	/* first byte is report-id which is 0x02 for LEDs in our rdesc */
-	if (ev->u.output.data[0] != 0x2)
-		return;
-
-	/* print flags payload */
-    if (g_verbose)
-        fprintf(stderr, "LED output report received with flags %x\n",
-            ev->u.output.data[1]);
+	if (i < 2) {
+		rep->data[2 + 2 * i] = v & 0xff;
+		rep->data[3 + 2 * i] = (v >> 8) & 0xff;
+	} else {
+		rep->data[4 + i] = v & 0xff;
+	}
 }
 
-static int event(int fd)
+/* A relative report that moves is news even if it repeats the previous one */
+static inline bool mouse_moves(const struct uhid_report *rep)
 {
-	struct uhid_event ev;
-	ssize_t ret;
-
-	memset(&ev, 0, sizeof(ev));
-	ret = read(fd, &ev, sizeof(ev));
-	if (ret == 0) {
-		fprintf(stderr, "Read HUP on uhid-cdev\n");
-		return -EFAULT;
-	} else if (ret < 0) {
-		fprintf(stderr, "Cannot read uhid-cdev: %m\n");
-		return -errno;
-	} else if (ret != sizeof(ev)) {
-		fprintf(stderr, "Invalid size read from uhid-dev: %zd != %zu\n",
-			ret, sizeof(ev));
-		return -EFAULT;
-	}
-
-	switch (ev.type) {
-	case UHID_START:
-    if (g_verbose) fprintf(stderr, "UHID_START from uhid-dev\n");
-		break;
-	case UHID_STOP:
-    if (g_verbose) fprintf(stderr, "UHID_STOP from uhid-dev\n");
-		break;
-	case UHID_OPEN:
-    if (g_verbose) fprintf(stderr, "UHID_OPEN from uhid-dev\n");
-		break;
-	case UHID_CLOSE:
-    if (g_verbose) fprintf(stderr, "UHID_CLOSE from uhid-dev\n");
-		break;
-	case UHID_OUTPUT:
-    if (g_verbose) fprintf(stderr, "UHID_OUTPUT from uhid-dev\n");
-		handle_output(&ev);
-		break;
-	case UHID_OUTPUT_EV:
-		fprintf(stderr, "UHID_OUTPUT_EV from uhid-dev\n");
-		break;
-	default:
-		fprintf(stderr, "Invalid event from uhid-dev: %u\n", ev.type);
-	}
+	static const __u8 still[6];
 
-	return 0;
+	return rep->data[0] == REPORT_ID_MOUSE && memcmp(&rep->data[2], still, sizeof(still));
 }
 
-/* Keyboard state tracking */
-static unsigned char modifier_keys = 0;  /* Bitfield for modifier keys */
-static unsigned char key_codes[6] = {0};  /* Array for up to 6 simultaneous key presses */
-static int num_keys_pressed = 0;          /* Number of keys currently pressed */
+/*
+ * Batched report submission
+ * Submitted reports are copied into the device's batch[] and handed to the
+ * kernel with a single writev() per flush. The uhid cdev has no write_iter,
+ * so the VFS loops over the iovec and feeds every segment to
+ * uhid_char_write() as one event; a whole keyboard() pass thus costs one
+ * syscall instead of two per character. With UHID_BATCH=0 every report is
+ * flushed as soon as it is submitted, which matches the historic
+ * one-write-per-report behaviour.
+ *
+ * Kernels that predate UHID_INPUT2 reject the first such write, in which
+ * case this and all further reports are converted to full-sized legacy
+ * UHID_INPUT events and written one at a time.
+ */
+#define UHID_BATCH_MAX 256
+
+/*
+ * Benchmark accounting: while --bench runs, every write()/writev() to the
+ * uhid cdev records its latency and the number of reports it carried.
+ */
+struct bench_stats {
+	uint32_t *lat;		/* ns per syscall */
+	size_t n_lat, cap_lat;
+	uint64_t reports;
+	uint64_t writes;
+};
 
-/* Escape sequence buffer for arrow keys */
-static char escape_buf[8];
-static int escape_len = 0;
-static unsigned char pending_consumer_bits = 0; /* bitfield for consumer actions from escape sequences */
+static struct bench_stats *bench;
 
-static int send_event(int fd)
+static void bench_record(uint64_t t0, int reports)
 {
-	struct uhid_event ev;
+	uint64_t dt = now_ns() - t0;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.type = UHID_INPUT;
-    ev.u.input.size = 9;  /* 1 byte report-id + 1 byte modifiers + 1 reserved + 6 keys */
+	bench->reports += reports;
+	bench->writes++;
+	if (bench->n_lat < bench->cap_lat)
+		bench->lat[bench->n_lat++] = dt > UINT32_MAX ? UINT32_MAX : dt;
+}
 
-    ev.u.input.data[0] = 0x01;           /* Report ID: Keyboard */
-    ev.u.input.data[1] = modifier_keys;  /* Modifier keys bitfield */
-    ev.u.input.data[2] = 0;              /* Reserved byte */
-	
-	/* Ensure no stale keycodes remain in the report on key-up */
-    memset(&ev.u.input.data[3], 0, 6);
-	if (num_keys_pressed > 0) {
-		/* Copy only currently pressed keys */
-		int copy_len = num_keys_pressed > 6 ? 6 : num_keys_pressed;
-        memcpy(&ev.u.input.data[3], key_codes, copy_len);
-	}
+/*
+ * Metrics
+ * Counters and histograms of the injection path that stay on in normal
+ * runs: every update is a relaxed atomic add, so the writer thread takes
+ * part without any locking. Histograms are log-linear in the manner of
+ * HdrHistogram, four buckets per power of two, which bounds the error of
+ * any value to 25% with 256 buckets for the whole 64-bit range. Reports
+ * written through io_uring are counted but their writes are not timed.
+ * metrics_print() renders them in the Prometheus text format, see
+ * "Metrics export" below.
+ */
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
 
-    /* Debug output for all HID reports */
-    if (g_verbose) {
-        if (num_keys_pressed > 0) {
-            fprintf(stderr, "HID Report (ID=1): modifiers=0x%02x, keys=[", modifier_keys);
-            for (int i = 0; i < 6; i++) {
-                if (key_codes[i] != 0) {
-                    fprintf(stderr, "0x%02x ", key_codes[i]);
-                }
-            }
-            fprintf(stderr, "]\n");
-        } else {
-            fprintf(stderr, "HID Report: modifiers=0x%02x, keys=[ ] (no keys pressed)\n", modifier_keys);
-        }
-    }
+struct hist {
+	atomic_ullong count;
+	atomic_ullong sum;
+	atomic_ullong bucket[HIST_BUCKETS];
+};
 
-	return uhid_write(fd, &ev);
-}
+static struct {
+	atomic_ullong reports[REPORT_ID_COUNT];	/* written, by report ID */
+	atomic_ullong bytes;			/* written to the uhid cdev */
+	atomic_ullong unknown_chars;
+	atomic_ullong esc_dropped;		/* ignored or incomplete sequences */
+	atomic_ullong sched_dropped;		/* reports the pacing queue had no room for */
+	struct hist write_ns;			/* per write()/writev() */
+	struct hist write_reports;		/* reports per write()/writev() */
+	struct hist input_bytes;		/* per read() or mapped chunk of an input */
+} metrics;
 
-/* Send a 1-byte Consumer Control report for Volume keys */
-static int send_consumer_event(int fd, unsigned char bits)
-{
-    struct uhid_event ev;
+#define metric_add(m, n) atomic_fetch_add_explicit(&(m), (n), memory_order_relaxed)
 
-    memset(&ev, 0, sizeof(ev));
-    ev.type = UHID_INPUT;
-    ev.u.input.size = 2;  /* 1 byte report-id + 1 byte: bit0=Vol+, bit1=Vol-, bit2=Play/Pause */
-    ev.u.input.data[0] = 0x02; /* Report ID: Consumer */
-    ev.u.input.data[1] = bits;
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
 
-    if (g_verbose) {
-        fprintf(stderr, "Consumer Report (ID=2): bits=0x%02x\n", bits);
-    }
+	if (v < (1u << HIST_SUB_BITS))
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
 
-    return uhid_write(fd, &ev);
-}
-
-/* Map ASCII character to HID key code */
-static unsigned char ascii_to_hid(char c)
-{
-	if (c >= 'a' && c <= 'z')
-		return HID_A + (c - 'a');  /* HID_A = 0x04 */
-	if (c >= 'A' && c <= 'Z')
-		return HID_A + (c - 'A');  /* Same as lowercase */
-	if (c >= '1' && c <= '9')
-		return HID_1 + (c - '1');  /* HID_1 = 0x1e */
-	if (c == '0')
-		return HID_0;  /* HID_0 = 0x27 */
-    if (c == ' ')
-        return HID_KEY_SPACE;
-    if (c == '\n' || c == '\r')
-        return HID_KEY_ENTER;
-    if (c == '\b')
-        return HID_KEY_BACKSPACE;
-    if ((unsigned char)c == 0x7f)
-        return HID_KEY_BACKSPACE;
-    if (c == '\t')
-        return HID_TAB;  /* HID_TAB */
-    if (c == 27)  /* ESC */
-        return HID_KEY_ESC;
-	
-	/* Special characters */
-	switch (c) {
-	case '!': return 0x1e;  /* 1 */
-	case '@': return 0x1f;  /* 2 */
-	case '#': return 0x20;  /* 3 */
-	case '$': return 0x21;  /* 4 */
-	case '%': return 0x22;  /* 5 */
-	case '^': return 0x23;  /* 6 */
-	case '&': return 0x24;  /* 7 */
-	case '*': return 0x25;  /* 8 */
-	case '(': return 0x26;  /* 9 */
-	case ')': return 0x27;  /* 0 */
-	case '-': return 0x2d;  /* HID_MINUS */
-	case '=': return 0x2e;  /* HID_EQUAL */
-	case '[': return 0x2f;  /* HID_LEFTBRACE */
-	case ']': return 0x30;  /* HID_RIGHTBRACE */
-	case '\\': return 0x31; /* HID_BACKSLASH */
-	case ';': return 0x33;  /* HID_SEMICOLON */
-	case '\'': return 0x34; /* HID_APOSTROPHE */
-	case '`': return 0x35;  /* HID_GRAVE */
-	case ',': return 0x36;  /* HID_COMMA */
-	case '.': return 0x37;  /* HID_DOT */
-	case '/': return 0x38;  /* HID_SLASH */
-	default: return 0;  /* Unknown character */
-	}
-}
-
-/* Process escape sequence buffer and return HID code if complete */
-static unsigned char process_escape_sequence(void)
-{
-	if (escape_len >= 3 && escape_buf[0] == 27 && escape_buf[1] == '[') {
-		unsigned char hid_code = 0;
-		switch (escape_buf[2]) {
-		case 'A': hid_code = HID_KEY_UP; break;  /* HID_UP_ARROW */
-		case 'B': hid_code = HID_KEY_DOWN; break;  /* HID_DOWN_ARROW */
-		case 'C': hid_code = HID_KEY_RIGHT; break;  /* HID_RIGHT_ARROW */
-		case 'D': hid_code = HID_KEY_LEFT; break;  /* HID_LEFT_ARROW */
-		}
-		if (hid_code != 0) {
-			/* Clear the escape buffer */
-			escape_len = 0;
-			return hid_code;
-		}
-	}
-    /* ESC [ 19 ~  => Play/Pause consumer control */
-    if (escape_len >= 5 && escape_buf[0] == 27 && escape_buf[1] == '[' &&
-        escape_buf[2] == '1' && escape_buf[3] == '9' && escape_buf[4] == '~') {
-        /* consume the sequence and schedule a consumer report */
-        escape_len = 0;
-        pending_consumer_bits = 0x04; /* Play/Pause bit */
-        return 0; /* no keyboard HID code */
-    }
-	return 0;  /* Not a complete arrow key sequence */
+static void hist_add(struct hist *h, uint64_t v)
+{
+	metric_add(h->count, 1);
+	metric_add(h->sum, v);
+	metric_add(h->bucket[hist_index(v)], 1);
 }
 
-/* Add character to escape sequence buffer */
-static void add_to_escape_buf(char c)
+#ifndef UHID_KBD_LIB
+/* Largest value that falls into bucket @idx */
+static uint64_t hist_upper(unsigned int idx)
 {
-	if (escape_len < sizeof(escape_buf) - 1) {
-		escape_buf[escape_len++] = c;
-	} else {
-		/* Buffer overflow, reset */
-		escape_len = 0;
-	}
+	unsigned int e = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = idx & ((1u << HIST_SUB_BITS) - 1);
+
+	if (idx < (1u << HIST_SUB_BITS))
+		return idx;
+	return (((1ull << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS)) - 1;
 }
 
-/* Add a key to the pressed keys array */
-static void add_key(unsigned char hid_code)
+/* Upper bound of the bucket holding quantile @q, 0 for an empty histogram */
+static uint64_t hist_quantile(struct hist *h, double q)
 {
-	if (num_keys_pressed >= 6) return;  /* Maximum 6 keys */
-	
-	for (int i = 0; i < num_keys_pressed; i++) {
-		if (key_codes[i] == hid_code) return;  /* Already pressed */
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	uint64_t rank = q * count, seen = 0;
+
+	for (unsigned int i = 0; i < HIST_BUCKETS && count; i++) {
+		seen += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+		if (seen > rank)
+			return hist_upper(i);
 	}
-	
-	key_codes[num_keys_pressed++] = hid_code;
+	return 0;
 }
+#endif
 
-/* Remove a key from the pressed keys array */
-static void remove_key(unsigned char hid_code)
+/* Account @n reports that went out as UHID_INPUT2 */
+static void metrics_sent(const struct uhid_report *rep, int n)
 {
-	for (int i = 0; i < num_keys_pressed; i++) {
-		if (key_codes[i] == hid_code) {
-			/* Shift remaining keys left */
-			for (int j = i; j < num_keys_pressed - 1; j++) {
-				key_codes[j] = key_codes[j + 1];
-			}
-			/* Clear the now-unused last slot to avoid stale values */
-			num_keys_pressed--;
-			key_codes[num_keys_pressed] = 0;
-			break;
-		}
+	size_t bytes = 0;
+
+	for (int i = 0; i < n; i++) {
+		metric_add(metrics.reports[rep[i].data[0] < REPORT_ID_COUNT ? rep[i].data[0] : 0], 1);
+		bytes += UHID_REPORT_LEN(&rep[i]);
 	}
+	metric_add(metrics.bytes, bytes);
 }
 
-/* Clear all pressed keys */
-static void clear_keys(void)
+/* Account one write()/writev() that started at @t0 and carried @reports */
+static void metrics_write(uint64_t t0, int reports)
 {
-	memset(key_codes, 0, sizeof(key_codes));
-	num_keys_pressed = 0;
-	modifier_keys = 0;
+	hist_add(&metrics.write_ns, now_ns() - t0);
+	hist_add(&metrics.write_reports, reports);
 }
 
-static int keyboard(int fd)
+/* Write reports one by one as legacy UHID_INPUT events */
+static int uhid_write_legacy(int fd, const struct uhid_report *rep, int n)
 {
-	char buf[128];
-	ssize_t ret, i;
+	struct uhid_event legacy_ev = { .type = UHID_INPUT };
+	int ret;
 
-	ret = read(STDIN_FILENO, buf, sizeof(buf));
-	if (ret == 0) {
-		fprintf(stderr, "Read HUP on stdin\n");
-		return -EFAULT;
-	} else if (ret < 0) {
-		fprintf(stderr, "Cannot read stdin: %m\n");
-		return -errno;
-	}
+	for (int i = 0; i < n; i++) {
+		uint64_t t0 = now_ns();
 
-	for (i = 0; i < ret; ++i) {
-		unsigned char hid_code = 0;
-		const char *key_name = "UNKNOWN";
-		
-		/* Check if we're in the middle of an escape sequence */
-		if (escape_len > 0) {
-			/* We're building an escape sequence */
-			add_to_escape_buf(buf[i]);
-			hid_code = process_escape_sequence();
-			
-        if (hid_code != 0) {
-				/* We have a complete arrow key sequence */
-            switch (escape_buf[2]) {
-            case 'A': key_name = "UP_ARROW"; break;
-            case 'B': key_name = "DOWN_ARROW"; break;
-            case 'C': key_name = "RIGHT_ARROW"; break;
-            case 'D': key_name = "LEFT_ARROW"; break;
-            }
-        } else if (escape_len == 0 && pending_consumer_bits != 0) {
-            /* Special handled sequence consumed (e.g., Play/Pause) */
-            send_consumer_event(fd, pending_consumer_bits);
-            send_consumer_event(fd, 0x00);
-            key_name = (pending_consumer_bits & 0x04) ? "PLAY_PAUSE" : key_name;
-            pending_consumer_bits = 0;
-            continue;
-			} else {
-				/* Still building escape sequence, continue */
-				continue;
-			}
-		} else if (buf[i] == 27) {
-			/* Check if this is a standalone ESC or start of arrow sequence */
-			if (i + 1 < ret && buf[i+1] == '[') {
-				/* This is the start of an arrow key sequence */
-				add_to_escape_buf(buf[i]);
-				/* Don't process yet, wait for the full sequence */
-				continue;
-			} else {
-				/* This is a standalone ESC key */
-				hid_code = ascii_to_hid(buf[i]);
-				key_name = "ESC";
-			}
-		} else {
-			/* Regular character */
-			/* Map consumer volume keys on '{' and '}' */
-			if (buf[i] == '{') {
-				/* Volume Down press + release */
-				send_consumer_event(fd, 0x02);
-				send_consumer_event(fd, 0x00);
-				key_name = "VOLUME_DOWN";
-				continue;
-			} else if (buf[i] == '}') {
-				/* Volume Up press + release */
-				send_consumer_event(fd, 0x01);
-				send_consumer_event(fd, 0x00);
-				key_name = "VOLUME_UP";
-				continue;
-			}
-			hid_code = ascii_to_hid(buf[i]);
-			if (buf[i] == ' ') key_name = "SPACE";
-			else if (buf[i] == '\n' || buf[i] == '\r') key_name = "ENTER";
-            else if (buf[i] == '\b' || (unsigned char)buf[i] == 0x7f) key_name = "BACKSPACE";
-			else if (buf[i] == 27) key_name = "ESC";
-			else if (buf[i] >= 'a' && buf[i] <= 'z') key_name = "LETTER";
-			else if (buf[i] >= 'A' && buf[i] <= 'Z') key_name = "LETTER";
-			else if (buf[i] >= '0' && buf[i] <= '9') key_name = "NUMBER";
-		}
-		
-		if (hid_code == 0) {
-			fprintf(stderr, "Unknown character: %c (0x%02x)\n", buf[i], (unsigned char)buf[i]);
-			continue;
-		}
-		
-        /* Debug output for all keys */
-        if (g_verbose) {
-            fprintf(stderr, "Processing character: %c (0x%02x) -> %s (HID code: 0x%02x)\n", 
-                buf[i], (unsigned char)buf[i], key_name, hid_code);
-        }
-		
-		/* Check for shift requirement (exclude non-printable like arrows) */
-        if (IS_UPPER_ALPHA(buf[i]) &&
-            !(hid_code == HID_KEY_UP || hid_code == HID_KEY_DOWN || hid_code == HID_KEY_RIGHT || hid_code == HID_KEY_LEFT)) {
-            modifier_keys |= HID_MOD_LSHIFT;  /* Left Shift */
-		}
-		
-		/* Press the key */
-		add_key(hid_code);
-		send_event(fd);
-		
-		/* Release the key */
-		remove_key(hid_code);
-        if (IS_UPPER_ALPHA(buf[i]) &&
-            !(hid_code == HID_KEY_UP || hid_code == HID_KEY_DOWN || hid_code == HID_KEY_RIGHT || hid_code == HID_KEY_LEFT)) {
-            modifier_keys &= ~HID_MOD_LSHIFT;  /* Release Left Shift */
-		}
-		send_event(fd);
+		memcpy(legacy_ev.u.input.data, rep[i].data, rep[i].size);
+		legacy_ev.u.input.size = rep[i].size;
+		ret = uhid_write(fd, &legacy_ev, sizeof(legacy_ev));
+		if (ret)
+			return ret;
+		metrics_write(t0, 1);
+		metric_add(metrics.reports[rep[i].data[0] < REPORT_ID_COUNT ? rep[i].data[0] : 0], 1);
+		metric_add(metrics.bytes, sizeof(legacy_ev));
+		if (bench)
+			bench_record(t0, 1);
 	}
-
 	return 0;
 }
 
-int main(int argc, char **argv)
-{
-	int fd;
-	const char *path = "/dev/uhid";
-	struct pollfd pfds[2];
-	int ret;
-	struct termios state;
+/*
+ * Report pacing
+ * Some consumers coalesce or drop reports that arrive back to back. With
+ * --rate and/or --hold, reports go through sched_submit() which spaces
+ * them out: --rate sets the minimum interval between any two reports and
+ * --hold the interval between a key press and its release. Reports that
+ * are not due yet wait in the device's sched_q[] and a timerfd in the main
+ * epoll set fires when the head of the queue is due, so input and uhid
+ * events keep being handled in between and nothing ever sleeps or spins.
+ * Without pacing sched_submit() is a plain uhid_submit().
+ *
+ * The kernel hands reports on whether or not anyone has the input device
+ * open, so keys sent before the first reader shows up are simply lost.
+ * With --wait-open a device is held until UHID_OPEN and again after
+ * UHID_CLOSE: its reports wait in the queue and the timer is set to when
+ * the oldest of them gives up waiting and everything is sent anyway.
+ */
+#define SCHED_MAX 8192	/* power of two */
 
-	ret = tcgetattr(STDIN_FILENO, &state);
-	if (ret) {
-		fprintf(stderr, "Cannot get tty state\n");
-	} else {
-		state.c_lflag &= ~ICANON;
-		state.c_cc[VMIN] = 1;
-		ret = tcsetattr(STDIN_FILENO, TCSANOW, &state);
-		if (ret)
-			fprintf(stderr, "Cannot set tty state\n");
-	}
+struct paced_report {
+	struct uhid_report rep;
+	uint64_t gap_ns;	/* minimum time after the previous report */
+};
 
-	if (argc >= 2) {
-		if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
-			fprintf(stderr, "Usage: %s [%s]\n", argv[0], path);
-			return EXIT_SUCCESS;
-		} else {
-			path = argv[1];
-		}
-	}
+static uint64_t g_rate_gap_ns = 0;	/* --rate, as an interval */
+static uint64_t g_hold_ns = 0;		/* --hold */
+static uint64_t g_wait_open_ns = 0;	/* --wait-open */
+static bool g_pacing = false;
 
-    const char *env_verbose = getenv("UHID_VERBOSE");
-    if (env_verbose && (!strcmp(env_verbose, "0") || !strcasecmp(env_verbose, "false")))
-        g_verbose = 0;
+/* A key held down by the hold command, see "Held keys" below */
+struct held_key {
+	struct held_key *next, **pprev;	/* in a wheel slot, pprev NULL if not */
+	struct uhid_dev *dev;
+	uint64_t tick;			/* next expiry, in ms of CLOCK_MONOTONIC */
+	uint64_t release;		/* 0: only on "release" */
+	unsigned int period;		/* ms between repeats, 0: host typematic */
+	unsigned char usage, mods;
+	unsigned char level, slot;
+};
 
-    fprintf(stderr, "Open uhid-cdev %s\n", path);
-	fd = open(path, O_RDWR | O_CLOEXEC);
-	if (fd < 0) {
-		fprintf(stderr, "Cannot open uhid-cdev %s: %m\n", path);
-		return EXIT_FAILURE;
-	}
+/*
+ * Input decoder state: escape sequences, see "Terminal escape sequences"
+ * below, and UTF-8 characters split across reads
+ */
+enum esc_state {
+	ESC_GROUND,	/* plain characters */
+	ESC_ESC,	/* ESC seen */
+	ESC_CSI,	/* ESC [ seen, collecting parameters */
+	ESC_SS3,	/* ESC O seen */
+};
 
-	fprintf(stderr, "Create uhid device\n");
-	ret = create(fd);
-	if (ret) {
-		close(fd);
-		return EXIT_FAILURE;
-	}
+struct esc_parser {
+	unsigned char state;
+	unsigned char nparam;
+	unsigned short param[2];
+	unsigned char utf8_need;	/* continuation bytes still to come */
+	unsigned char utf8_len;		/* of the character being decoded */
+	uint32_t cp;			/* its bits so far */
+	uint64_t deadline;	/* when a pending ESC turns into the Escape key */
+};
 
-	pfds[0].fd = STDIN_FILENO;
-	pfds[0].events = POLLIN;
-	pfds[1].fd = fd;
-	pfds[1].events = POLLIN;
+/* Binary record framing, see "Binary records" below */
+struct bin_record {
+	__u8 report_id;		/* 1 keyboard, 2 consumer, 0 select device */
+	__u8 mods;
+	__u8 usages[6];		/* report ID 2: consumer usage, le16 in usages[0-1] */
+	__le16 hold_ms;		/* release after this long, 0 = leave as is */
+} __attribute__((__packed__));
 
-	fprintf(stderr, "Keyboard UHID device created. Type any characters to send as keyboard input.\n");
-	while (1) {
-		ret = poll(pfds, 2, -1);
-		if (ret < 0) {
-			fprintf(stderr, "Cannot poll for fds: %m\n");
+struct uhid_dev;
+struct macro;
+
+struct bin_stream {
+	struct uhid_dev *dev;	/* target of the records */
+	size_t len;
+	unsigned char part[sizeof(struct bin_record)];	/* incomplete record */
+};
+
+/*
+ * Devices
+ * Everything that belongs to one virtual keyboard lives in its struct
+ * uhid_dev: the uhid fd, name and IDs, key state, report templates, the
+ * batch and pacing queues and the input stream routed to it. Any number of
+ * them (--device) share one process and one epoll instance in main(); the
+ * default is a single "test-uhid-device" fed from stdin or --input.
+ */
+#define MAX_DEVICES 64
+#define CHORD_MAX 32
+
+struct uhid_dev {
+	struct uhid_report kbd_report __attribute__((aligned(64)));
+	struct uhid_report consumer_report __attribute__((aligned(64)));
+	struct uhid_report nkro_report __attribute__((aligned(64)));
+	struct uhid_report mouse_report __attribute__((aligned(64)));
+	struct uhid_report abs_report __attribute__((aligned(64)));
+	struct uhid_report batch[UHID_BATCH_MAX] __attribute__((aligned(64)));
+	struct iovec batch_iov[UHID_BATCH_MAX];
+	int batch_len;
+
+	int fd;
+	char name[128];
+	__u32 vendor;
+	__u32 product;
+	bool nkro;		/* send report ID 3 instead of 1 */
+	bool pointer;		/* report IDs 4 and 5 as well */
+	bool created;
+	bool started;		/* between UHID_START and UHID_STOP */
+	bool held;		/* --wait-open: queue reports, nobody reads them */
+	uint64_t open_deadline;	/* held reports go out anyway after this */
+	__u8 leds;		/* host LED state, bit n is LED_* code n */
+	bool leds_known;	/* leds came from the host */
+	bool input2;		/* cleared once the kernel rejects UHID_INPUT2 */
+	bool input2_confirmed;	/* a UHID_INPUT2 write went through */
+
+	/*
+	 * Keyboard state tracking: one bit per pressed usage, plus the slot
+	 * of each usage in the six-key array of report ID 1 so that press and
+	 * release never scan
+	 */
+	unsigned char modifier_keys;	/* Bitfield for modifier keys */
+	unsigned char key_bits[32];	/* Bitmap of pressed usages */
+	unsigned char key_codes[6];	/* Array for up to 6 simultaneous key presses */
+	unsigned char key_slot[256];	/* key_codes[] index + 1, 0 if not in it */
+	int num_keys_pressed;		/* Number of keys currently pressed */
+	int num_key_codes;		/* Used slots of key_codes[] */
+	unsigned char chord_keys[CHORD_MAX];	/* --coalesce: pressed, not yet sent */
+	int chord_len;
+	struct held_key *holds[256];	/* by usage, see "Held keys" below */
+	unsigned char held_mods;	/* modifiers of the held keys */
+
+	/* Pointer state, see "Pointer motion" below */
+	__u8 buttons;
+	bool pointer_abs;		/* buttons go out in report ID 5 */
+	int move[4];			/* X, Y, wheel, pan not sent yet */
+	bool abs_pending;		/* abs_x/abs_y not sent yet */
+	uint64_t frame_ns;		/* when pending motion goes out, 0: none */
+	__u16 abs_x, abs_y;
+
+	/* Last report submitted per report ID, see "Duplicate reports" below */
+	__u8 last_sent[REPORT_ID_COUNT][UHID_REPORT_MAX];
+	uint64_t dup_reports;		/* identical reports that were not sent */
+
+	/* --nonblock: reports the kernel did not take yet, see "Backpressure" */
+	struct uhid_report *out_q;
+	unsigned int out_head, out_tail;
+	bool out_polled;		/* uhid fd watched for EPOLLOUT */
+	uint64_t out_dropped;		/* lost to the overflow policy */
+
+	/* Pacing queue, only allocated with --rate or --hold */
+	struct paced_report *sched_q;
+	unsigned int sched_head, sched_tail;
+	uint64_t sched_last_ns;		/* when the last report was submitted */
+	int sched_tfd;
+
+	/* Input stream, see "Input streams" below */
+	char *in_path;			/* "-" for stdin, NULL for none */
+	int in_fd;
+	bool in_bulk;			/* a file or pipe, not a tty */
+	bool in_eager;			/* not pollable, fed every loop pass */
+	bool in_polled;			/* currently in the epoll set */
+	bool in_done;
+	const char *map;		/* mapped regular file */
+	size_t map_size, map_off;
+	uint64_t start_deadline;	/* bulk input waits for UHID_START */
+	bool in_binary;			/* --binary records instead of text */
+	struct esc_parser esc;
+	struct bin_stream bin;
+
+	struct macro *capture;		/* compiling: reports go here instead */
+	uint64_t capture_delay_ns;	/* extra gap before the next report */
+
+#ifdef UHID_IO_URING
+	/* io_uring backend, see "io_uring" below */
+	bool ring;			/* buffers registered, I/O goes through the ring */
+	int ring_idx;			/* index in devs[] and of the registered buffers */
+	int ring_writes;		/* batch[] writes in flight */
+	int ring_fail;			/* first batch[] slot that failed, -1 if none */
+	int ring_fail_res;
+	int ring_err;			/* write error for the next flush to return */
+	bool uhid_reading;		/* a uhid read is in flight */
+	bool uhid_read_done;		/* ...and completed with uhid_read_res */
+	int uhid_read_res;
+	bool in_reading;		/* same for the input stream */
+	bool in_read_done;
+	int in_read_res;
+#endif
+};
+
+/* The program's devices, a library keyboard never joins them */
+#if !defined(UHID_KBD_LIB) || defined(UHID_FUZZ)
+static struct uhid_dev *devs[MAX_DEVICES];
+static int n_devs;
+#endif
+
+#ifndef UHID_KBD_LIB
+static int g_epfd = -1;
+#endif
+
+/* epoll_event.data.u64: device index and event source */
+enum { SRC_UHID, SRC_INPUT, SRC_TIMER, SRC_LISTEN, SRC_CLIENT, SRC_METRICS,
+       SRC_METRICS_CLIENT, SRC_SIGNAL, SRC_WHEEL, SRC_REPLAY };
+#define EP_TAG(idx, src)	(((uint64_t)(idx) << 8) | (src))
+
+/* Initialize the storage at @dev as a device that is not open yet */
+static void dev_init(struct uhid_dev *dev, const char *name, __u32 vendor, __u32 product)
+{
+	memset(dev, 0, sizeof(*dev));
+
+	dev->kbd_report.type = UHID_INPUT2;
+	dev->kbd_report.size = 9;		/* 1 byte report-id + 1 byte modifiers + 1 reserved + 6 keys */
+	dev->kbd_report.data[0] = 0x01;		/* Report ID: Keyboard */
+	dev->consumer_report.type = UHID_INPUT2;
+	dev->consumer_report.size = 3;		/* 1 byte report-id + 16-bit consumer usage */
+	dev->consumer_report.data[0] = 0x02;	/* Report ID: Consumer */
+	dev->nkro_report.type = UHID_INPUT2;
+	dev->nkro_report.size = 2 + NKRO_BITMAP_BYTES;	/* report-id + modifiers + bitmap */
+	dev->nkro_report.data[0] = 0x03;	/* Report ID: NKRO keyboard */
+	dev->mouse_report.type = UHID_INPUT2;
+	dev->mouse_report.size = 8;		/* report-id + buttons + X, Y + wheel + pan */
+	dev->mouse_report.data[0] = REPORT_ID_MOUSE;
+	dev->abs_report.type = UHID_INPUT2;
+	dev->abs_report.size = 6;		/* report-id + buttons + X, Y */
+	dev->abs_report.data[0] = REPORT_ID_ABS;
+
+	dev->fd = -1;
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	dev->vendor = vendor;
+	dev->product = product;
+	dev->sched_tfd = -1;
+	dev->in_fd = -1;
+	dev->input2 = true;
+}
+
+#ifndef UHID_KBD_LIB
+static struct uhid_dev *dev_alloc(const char *name, __u32 vendor, __u32 product)
+{
+	struct uhid_dev *dev;
+
+	dev = aligned_alloc(64, sizeof(*dev));
+	if (!dev) {
+		log_error("Cannot allocate device: %m\n");
+		return NULL;
+	}
+	dev_init(dev, name, vendor, product);
+	return dev;
+}
+
+static struct uhid_dev *dev_new(const char *name, __u32 vendor, __u32 product)
+{
+	struct uhid_dev *dev;
+
+	if (n_devs == MAX_DEVICES) {
+		log_error("Too many devices, at most %d\n", MAX_DEVICES);
+		return NULL;
+	}
+	dev = dev_alloc(name, vendor, product);
+	if (dev)
+		devs[n_devs++] = dev;
+	return dev;
+}
+
+static void wheel_del(struct held_key *h);
+
+static void dev_free(struct uhid_dev *dev)
+{
+	if (dev->map)
+		munmap((void *)dev->map, dev->map_size);
+	if (dev->in_fd > STDIN_FILENO)
+		close(dev->in_fd);
+	if (dev->sched_tfd >= 0)
+		close(dev->sched_tfd);
+	for (int i = 0; i < 256; i++) {
+		if (dev->holds[i]) {
+			wheel_del(dev->holds[i]);
+			free(dev->holds[i]);
+		}
+	}
+	if (dev->fd >= 0)
+		close(dev->fd);
+	free(dev->sched_q);
+	free(dev->out_q);
+	free(dev->in_path);
+	free(dev);
+}
+#endif
+
+#ifdef UHID_IO_URING
+/*
+ * io_uring
+ * Built with -DUHID_IO_URING, run() drives the devices through one
+ * io_uring instead of a read()/writev() per event: every device keeps a
+ * uhid read and, for a pipe or tty, an input read in flight, and a flush
+ * turns batch[] into one IORING_OP_WRITE_FIXED per report, linked so that
+ * they reach the cdev in order and a failing report cancels the rest just
+ * like a short writev(). The remaining fds (timers, control sockets) stay
+ * in the epoll set, which is itself polled through the ring. One
+ * io_uring_enter() per pass of the main loop then submits the writes of
+ * all devices and waits for whatever completes next.
+ *
+ * The ring is set up with raw syscalls, there is no liburing dependency.
+ * The uhid cdev has neither ->write_iter nor nowait support, so the kernel
+ * runs these requests in its io-wq workers; fixed buffers spare it pinning
+ * and mapping user pages on every one of them. Kernels or sandboxes
+ * without io_uring make uring_init() fail and run() falls back to epoll.
+ *
+ * Completions are only recorded by uring_reap(). A flush that has to wait
+ * for the writes of an earlier one may reap uhid or input reads too, and
+ * those are handled later in uring_poll() rather than from inside the
+ * flush.
+ */
+#define URING_ENTRIES 1024
+
+/* cqe/sqe user_data: batch[] slot, device index and operation */
+enum { URING_POLL, URING_TIMEOUT, URING_UHID_READ, URING_INPUT_READ, URING_WRITE };
+#define URING_TAG(slot, idx, op)	(((uint64_t)(slot) << 16) | ((uint64_t)(idx) << 8) | (op))
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned int sq_entries, cq_entries;
+	unsigned int to_submit;		/* sqes queued since the last enter */
+	unsigned int inflight;		/* submitted or queued, not yet reaped */
+	bool polling;			/* epoll fd poll in flight */
+	bool poll_done;
+};
+
+static struct uring g_ring = { .fd = -1 };
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, g_ring.fd, to_submit, min_complete, flags, NULL, 0);
+	if (ret < 0)
+		return -errno;
+	g_ring.to_submit -= ret;
+	return 0;
+}
+
+/* Submit everything queued and, with @wait, block for one completion */
+static int uring_submit(bool wait)
+{
+	int ret;
+
+	do {
+		ret = uring_enter(g_ring.to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret == -EINTR);
+	if (ret && ret != -EBUSY && ret != -EAGAIN) {
+		log_error("Cannot submit to io_uring: %s\n", strerror(-ret));
+		return ret;
+	}
+	return 0;
+}
+
+static void uring_write_done(struct uhid_dev *dev, unsigned int slot, int res);
+
+/* Record every completion posted so far */
+static void uring_reap(void)
+{
+	unsigned int head = *g_ring.cq_head;
+	unsigned int tail = __atomic_load_n(g_ring.cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct uhid_dev *dev;
+
+	for (; head != tail; head++) {
+		cqe = &g_ring.cqes[head & *g_ring.cq_mask];
+		dev = devs[(cqe->user_data >> 8) & 0xff];
+		g_ring.inflight--;
+		switch (cqe->user_data & 0xff) {
+		case URING_POLL:
+			g_ring.polling = false;
+			g_ring.poll_done = true;
+			break;
+		case URING_UHID_READ:
+			dev->uhid_reading = false;
+			dev->uhid_read_done = true;
+			dev->uhid_read_res = cqe->res;
+			break;
+		case URING_INPUT_READ:
+			dev->in_reading = false;
+			dev->in_read_done = true;
+			dev->in_read_res = cqe->res;
+			break;
+		case URING_WRITE:
+			uring_write_done(dev, cqe->user_data >> 16, cqe->res);
+			break;
+		}
+	}
+	__atomic_store_n(g_ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Next free sqe, zeroed; submits or reaps first if either ring is full */
+static struct io_uring_sqe *uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *g_ring.sq_tail;
+
+	while (g_ring.inflight >= g_ring.cq_entries ||
+	       tail - __atomic_load_n(g_ring.sq_head, __ATOMIC_ACQUIRE) == g_ring.sq_entries) {
+		if (uring_submit(g_ring.inflight >= g_ring.cq_entries))
+			return NULL;
+		uring_reap();
+	}
+	sqe = &g_ring.sqes[tail & *g_ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	g_ring.sq_array[tail & *g_ring.sq_mask] = tail & *g_ring.sq_mask;
+	__atomic_store_n(g_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	g_ring.to_submit++;
+	g_ring.inflight++;
+	return sqe;
+}
+
+/* Queue batch[] as linked fixed-buffer writes; completed by uring_reap() */
+static int uring_flush(struct uhid_dev *dev)
+{
+	struct io_uring_sqe *sqe;
+
+	dev->ring_fail = -1;
+	for (int i = 0; i < dev->batch_len; i++) {
+		sqe = uring_sqe();
+		if (!sqe)
+			return -EIO;
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = dev->fd;
+		sqe->addr = (uintptr_t)&dev->batch[i];
+		sqe->len = dev->batch_iov[i].iov_len;
+		sqe->buf_index = 2 * dev->ring_idx;
+		sqe->user_data = URING_TAG(i, dev->ring_idx, URING_WRITE);
+		if (i < dev->batch_len - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		dev->ring_writes++;
+	}
+	return 0;
+}
+
+static void uring_write_done(struct uhid_dev *dev, unsigned int slot, int res)
+{
+	if ((res < 0 || (size_t)res != dev->batch_iov[slot].iov_len) &&
+	    (dev->ring_fail < 0 || slot < (unsigned int)dev->ring_fail)) {
+		dev->ring_fail = slot;
+		dev->ring_fail_res = res;
+	}
+	if (--dev->ring_writes)
+		return;
+
+	/* All of batch[] is back, the same outcomes as in uhid_flush() */
+	metrics_sent(dev->batch, dev->ring_fail < 0 ? dev->batch_len : dev->ring_fail);
+	if (dev->ring_fail < 0) {
+		dev->input2_confirmed = true;
+	} else if ((dev->ring_fail_res == -EINVAL || dev->ring_fail_res == -EOPNOTSUPP) &&
+		   !dev->input2_confirmed) {
+		log_warn("UHID_INPUT2 rejected, falling back to UHID_INPUT\n");
+		dev->input2 = false;
+		dev->ring_err = uhid_write_legacy(dev->fd, &dev->batch[dev->ring_fail],
+						  dev->batch_len - dev->ring_fail);
+	} else if (dev->ring_fail_res < 0) {
+		log_error("Cannot write to uhid (%s): %s\n", dev->name, strerror(-dev->ring_fail_res));
+		dev->ring_err = dev->ring_fail_res;
+	} else {
+		log_error("Wrong size written to uhid: %d bytes of a %zu byte event\n",
+			  dev->ring_fail_res, dev->batch_iov[dev->ring_fail].iov_len);
+		dev->ring_err = -EFAULT;
+	}
+	dev->batch_len = 0;
+}
+
+/* Wait until batch[] of @dev may be reused; returns a deferred write error */
+static int uring_wait_writes(struct uhid_dev *dev)
+{
+	int ret;
+
+	while (dev->ring_writes) {
+		ret = uring_submit(true);
+		if (ret)
+			return ret;
+		uring_reap();
+	}
+	ret = dev->ring_err;
+	dev->ring_err = 0;
+	return ret;
+}
+#endif
+
+/*
+ * Write the @n reports @rep, described by @iov, to the uhid cdev of @dev.
+ * Returns how many were written, which is less than @n only if the fd is
+ * non-blocking and full, or a negative error.
+ */
+static int uhid_write_reports(struct uhid_dev *dev, struct uhid_report *rep,
+			      struct iovec *iov, int n)
+{
+	int done = 0, first;
+	uint64_t t0;
+	ssize_t ret;
+
+	while (done < n) {
+		if (!dev->input2) {
+			ret = uhid_write_legacy(dev->fd, &rep[done], n - done);
+			return ret ? ret : n;
+		}
+
+		t0 = now_ns();
+		if (n - done == 1)
+			ret = write(dev->fd, iov[done].iov_base, iov[done].iov_len);
+		else
+			ret = writev(dev->fd, &iov[done], n - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return done;
+			if ((errno == EINVAL || errno == EOPNOTSUPP) && !dev->input2_confirmed) {
+				log_warn("UHID_INPUT2 rejected, falling back to UHID_INPUT\n");
+				dev->input2 = false;
+				continue;
+			}
+			ret = -errno;
+			log_error("Cannot write to uhid (%s): %m\n", dev->name);
+			return ret;
+		}
+		/* A failing segment stops the loop in the kernel; retry the rest */
+		dev->input2_confirmed = true;
+		first = done;
+		while (done < n && (size_t)ret >= iov[done].iov_len) {
+			ret -= iov[done].iov_len;
+			done++;
+		}
+		metrics_write(t0, done - first);
+		metrics_sent(&rep[first], done - first);
+		if (bench)
+			bench_record(t0, done - first);
+		if (ret) {
+			log_error("Wrong size written to uhid: %zd bytes of a %zu byte event\n",
+				ret, iov[done].iov_len);
+			return -EFAULT;
+		}
+	}
+	return n;
+}
+
+#ifndef UHID_KBD_LIB
+/*
+ * Backpressure (--nonblock)
+ * Normally the uhid fd is blocking and a write that stalls stalls the
+ * whole loop, input included. With --nonblock the fd is O_NONBLOCK and
+ * whatever the kernel does not take right away waits in the device's
+ * bounded out_q[]. As long as out_q[] is not empty, the uhid fd is also
+ * watched for EPOLLOUT and later flushes line up behind the queue, so the
+ * order of the reports never changes. What happens when out_q[] is full
+ * is up to the policy:
+ *
+ *   block        wait for the kernel, as a blocking fd would
+ *   drop-oldest  drop the oldest queued reports to make room
+ *   coalesce     keep only the newest queued report of each report ID;
+ *                every report carries the whole state of its ID, so the
+ *                host still ends up in the current state, without the
+ *                presses in between
+ *
+ * Dropped reports are counted in out_dropped.
+ */
+#define OUT_MAX 1024	/* power of two */
+
+enum { OVERFLOW_BLOCK, OVERFLOW_DROP_OLDEST, OVERFLOW_COALESCE };
+
+static bool g_nonblock = false;		/* --nonblock */
+static int g_overflow = OVERFLOW_BLOCK;	/* --nonblock=POLICY */
+
+static inline unsigned int out_len(const struct uhid_dev *dev)
+{
+	return dev->out_tail - dev->out_head;
+}
+
+/* Watch the uhid fd of @dev for EPOLLOUT as long as out_q[] is not empty */
+static void out_watch(struct uhid_dev *dev)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	bool want = out_len(dev) != 0;
+	int idx;
+
+	if (want == dev->out_polled)
+		return;
+	for (idx = 0; devs[idx] != dev; idx++)
+		;
+	if (want)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = EP_TAG(idx, SRC_UHID);
+	if (!epoll_ctl(g_epfd, EPOLL_CTL_MOD, dev->fd, &ev))
+		dev->out_polled = want;
+}
+
+/* Write as much of out_q[] as the kernel takes now */
+static int out_drain(struct uhid_dev *dev)
+{
+	struct iovec iov[UHID_BATCH_MAX];
+	unsigned int first, n;
+	int ret = 0;
+
+	while (out_len(dev)) {
+		/* The longest run that does not wrap */
+		first = dev->out_head & (OUT_MAX - 1);
+		for (n = 0; n < UHID_BATCH_MAX && n < out_len(dev) && first + n < OUT_MAX; n++) {
+			iov[n].iov_base = &dev->out_q[first + n];
+			iov[n].iov_len = UHID_REPORT_LEN(&dev->out_q[first + n]);
+		}
+		ret = uhid_write_reports(dev, &dev->out_q[first], iov, n);
+		if (ret < 0)
+			break;
+		dev->out_head += ret;
+		if ((unsigned int)ret < n) {
+			ret = 0;
+			break;
+		}
+		ret = 0;
+	}
+	out_watch(dev);
+	return ret;
+}
+
+/* Block until the kernel took everything in out_q[] or @timeout_ms passed */
+static int out_wait(struct uhid_dev *dev, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLOUT };
+	int ret;
+
+	while (out_len(dev)) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -ETIMEDOUT;
+		ret = out_drain(dev);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Keep the newest queued report of each report ID, in their order; older
+ * relative motion is added to the newest, as far as its axes go
+ */
+static void out_coalesce(struct uhid_dev *dev)
+{
+	bool seen[REPORT_ID_COUNT] = { false };
+	unsigned int keep = dev->out_tail, id, mouse = 0;
+
+	for (unsigned int i = dev->out_tail; i-- != dev->out_head; ) {
+		struct uhid_report *rep = &dev->out_q[i & (OUT_MAX - 1)];
+		struct uhid_report *last = &dev->out_q[mouse & (OUT_MAX - 1)];
+
+		id = rep->data[0] < REPORT_ID_COUNT ? rep->data[0] : 0;
+		if (seen[id] && id == REPORT_ID_MOUSE) {
+			for (int a = 0; a < 4; a++) {
+				int max = a < 2 ? INT16_MAX : INT8_MAX;
+				int v = mouse_axis(last, a) + mouse_axis(rep, a);
+
+				mouse_axis_set(last, a, v > max ? max : v < -max ? -max : v);
+			}
+		}
+		if (seen[id])
+			continue;
+		seen[id] = true;
+		keep--;
+		if (keep != i)
+			memcpy(&dev->out_q[keep & (OUT_MAX - 1)], rep, UHID_REPORT_LEN(rep));
+		if (id == REPORT_ID_MOUSE)
+			mouse = keep;
+	}
+	dev->out_dropped += keep - dev->out_head;
+	dev->out_head = keep;
+}
+
+/* Append @rep to out_q[], making room as the overflow policy says */
+static int out_push(struct uhid_dev *dev, const struct uhid_report *rep)
+{
+	int ret;
+
+	if (out_len(dev) == OUT_MAX) {
+		switch (g_overflow) {
+		case OVERFLOW_BLOCK:
+			while (out_len(dev) == OUT_MAX) {
+				ret = out_wait(dev, -1);
+				if (ret)
+					return ret;
+			}
+			break;
+		case OVERFLOW_DROP_OLDEST:
+			dev->out_head++;
+			dev->out_dropped++;
+			break;
+		case OVERFLOW_COALESCE:
+			out_coalesce(dev);
+			break;
+		}
+	}
+	memcpy(&dev->out_q[dev->out_tail++ & (OUT_MAX - 1)], rep, UHID_REPORT_LEN(rep));
+	return 0;
+}
+
+/* The non-blocking uhid_flush(): queue behind out_q[] or what did not fit */
+static int out_flush(struct uhid_dev *dev)
+{
+	int done = 0, ret = 0;
+
+	if (!out_len(dev)) {
+		done = uhid_write_reports(dev, dev->batch, dev->batch_iov, dev->batch_len);
+		if (done < 0) {
+			dev->batch_len = 0;
+			return done;
+		}
+	}
+	for (int i = done; i < dev->batch_len && !ret; i++)
+		ret = out_push(dev, &dev->batch[i]);
+	dev->batch_len = 0;
+	out_watch(dev);
+	return ret;
+}
+
+/*
+ * Writer thread
+ * With --writer-thread the uhid writes leave the main loop: uhid_flush()
+ * copies batch[] into a bounded single-producer/single-consumer ring and
+ * returns, and a writer thread, optionally pinned to one CPU, drains the
+ * ring to the cdevs with one writev() per run of reports for the same
+ * device. Parsing, UHID_OUTPUT handling and diagnostics then never wait
+ * for a write, and the writes never wait for them.
+ *
+ * The main thread is the only producer. head and tail sit on cache lines
+ * of their own and each side works from a private copy of the other's
+ * index, rereading the shared one only when the ring looks full or empty.
+ * An idle writer sleeps on an eventfd that the producer only signals after
+ * the writer announced it is going to sleep, and a producer waiting for
+ * room does the same the other way round.
+ */
+#define WRITER_RING_SIZE 4096	/* power of two */
+
+struct writer {
+	struct uhid_report rep[WRITER_RING_SIZE] __attribute__((aligned(64)));
+	struct uhid_dev *dev[WRITER_RING_SIZE];
+	_Alignas(64) atomic_uint head;		/* next slot the producer fills */
+	unsigned int tail_cache;		/* producer's copy of tail */
+	_Alignas(64) atomic_uint tail;		/* next slot the writer sends */
+	unsigned int head_cache;		/* writer's copy of head */
+	_Alignas(64) atomic_bool writer_idle;	/* writer sleeps on data_efd */
+	atomic_bool producer_full;		/* producer sleeps on room_efd */
+	atomic_bool stop;
+	atomic_int err;				/* first write error, for the producer */
+	int data_efd, room_efd;
+	pthread_t thread;
+};
+
+static struct writer *g_writer;
+static bool g_writer_thread = false;	/* --writer-thread */
+static int g_writer_cpu = -1;		/* --writer-thread=CPU */
+
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	struct iovec iov[UHID_BATCH_MAX];
+	unsigned int tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+	unsigned int first, n;
+	struct uhid_dev *dev;
+	eventfd_t val;
+	int ret, none;
+
+	for (;;) {
+		if (tail == w->head_cache)
+			w->head_cache = atomic_load_explicit(&w->head, memory_order_acquire);
+		if (tail == w->head_cache) {
+			atomic_store(&w->writer_idle, true);
+			if (atomic_load(&w->head) == tail) {
+				if (atomic_load(&w->stop))
+					break;
+				eventfd_read(w->data_efd, &val);
+			}
+			atomic_store(&w->writer_idle, false);
+			continue;
+		}
+
+		/* The longest run of reports for one device that does not wrap */
+		first = tail & (WRITER_RING_SIZE - 1);
+		dev = w->dev[first];
+		for (n = 0; n < UHID_BATCH_MAX && tail + n != w->head_cache &&
+		     first + n < WRITER_RING_SIZE && w->dev[first + n] == dev; n++) {
+			iov[n].iov_base = &w->rep[first + n];
+			iov[n].iov_len = UHID_REPORT_LEN(&w->rep[first + n]);
+		}
+		ret = uhid_write_reports(dev, &w->rep[first], iov, n);
+		none = 0;
+		if (ret < 0)
+			atomic_compare_exchange_strong(&w->err, &none, ret);
+
+		tail += n;
+		atomic_store(&w->tail, tail);
+		if (atomic_load(&w->producer_full))
+			eventfd_write(w->room_efd, 1);
+	}
+	return NULL;
+}
+
+/* Block until at most @used slots of the ring are taken */
+static void writer_wait(struct writer *w, unsigned int head, unsigned int used)
+{
+	eventfd_t val;
+
+	while (head - w->tail_cache > used) {
+		atomic_store(&w->producer_full, true);
+		w->tail_cache = atomic_load(&w->tail);
+		if (head - w->tail_cache > used)
+			eventfd_read(w->room_efd, &val);
+		atomic_store(&w->producer_full, false);
+		w->tail_cache = atomic_load(&w->tail);
+	}
+}
+
+/* Make [.., @head) visible to the writer and wake it if it sleeps */
+static void writer_publish(struct writer *w, unsigned int head)
+{
+	atomic_store(&w->head, head);
+	if (atomic_load(&w->writer_idle))
+		eventfd_write(w->data_efd, 1);
+}
+
+/* Hand batch[] of @dev to the writer; returns a write error seen since */
+static int writer_push(struct writer *w, struct uhid_dev *dev)
+{
+	unsigned int head = atomic_load_explicit(&w->head, memory_order_relaxed);
+	unsigned int slot;
+
+	for (int i = 0; i < dev->batch_len; i++) {
+		if (head - w->tail_cache == WRITER_RING_SIZE) {
+			w->tail_cache = atomic_load_explicit(&w->tail, memory_order_acquire);
+			if (head - w->tail_cache == WRITER_RING_SIZE) {
+				writer_publish(w, head);
+				writer_wait(w, head, WRITER_RING_SIZE - 1);
+			}
+		}
+		slot = head & (WRITER_RING_SIZE - 1);
+		memcpy(&w->rep[slot], &dev->batch[i], UHID_REPORT_LEN(&dev->batch[i]));
+		w->dev[slot] = dev;
+		head++;
+	}
+	writer_publish(w, head);
+	dev->batch_len = 0;
+	return atomic_exchange(&w->err, 0);
+}
+
+/* Wait until the writer sent everything pushed so far */
+static int writer_drain(void)
+{
+	struct writer *w = g_writer;
+
+	if (!w)
+		return 0;
+	writer_wait(w, atomic_load_explicit(&w->head, memory_order_relaxed), 0);
+	return atomic_exchange(&w->err, 0);
+}
+
+static int writer_start(void)
+{
+	struct writer *w;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int ret;
+
+	w = aligned_alloc(64, sizeof(*w));
+	if (!w) {
+		log_error("Cannot allocate writer ring: %m\n");
+		return -ENOMEM;
+	}
+	memset(w, 0, sizeof(*w));
+	w->data_efd = eventfd(0, EFD_CLOEXEC);
+	w->room_efd = eventfd(0, EFD_CLOEXEC);
+	if (w->data_efd < 0 || w->room_efd < 0) {
+		ret = -errno;
+		log_error("Cannot create writer eventfd: %m\n");
+		goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	if (g_writer_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(g_writer_cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	ret = -pthread_create(&w->thread, &attr, writer_main, w);
+	pthread_attr_destroy(&attr);
+	if (ret && g_writer_cpu >= 0) {
+		log_error("Cannot start writer thread on CPU %d: %s\n", g_writer_cpu, strerror(-ret));
+		goto fail;
+	} else if (ret) {
+		log_error("Cannot start writer thread: %s\n", strerror(-ret));
+		goto fail;
+	}
+	if (g_writer_cpu >= 0)
+		log_info("Writer thread pinned to CPU %d\n", g_writer_cpu);
+	g_writer = w;
+	return 0;
+
+fail:
+	if (w->data_efd >= 0)
+		close(w->data_efd);
+	if (w->room_efd >= 0)
+		close(w->room_efd);
+	free(w);
+	return ret;
+}
+
+/* Send what is left, then stop and join the writer */
+static void writer_stop(void)
+{
+	struct writer *w = g_writer;
+
+	if (!w)
+		return;
+	atomic_store(&w->stop, true);
+	eventfd_write(w->data_efd, 1);
+	pthread_join(w->thread, NULL);
+	close(w->data_efd);
+	close(w->room_efd);
+	free(w);
+	g_writer = NULL;
+}
+
+/*
+ * Report traces (--record, --replay)
+ * --record=FILE logs every report at the moment uhid_flush() hands it to
+ * the kernel, whichever backend writes it. The file is the magic
+ * TRACE_MAGIC followed by one record per report:
+ *
+ *   delta   ns since the previous record (the first: since the trace was
+ *           opened) as an LEB128 varint
+ *   dev     index of the device, in --device order
+ *   size    length of the report
+ *   data    the report itself, starting with its ID
+ *
+ * A keyboard report thus takes 12-14 bytes instead of the 64 of its event,
+ * and a trace reads front to back straight out of an mmap. --replay=FILE
+ * sends one back, see "Trace replay" below.
+ */
+#define TRACE_MAGIC "UHIDTRC1"
+
+static struct {
+	FILE *f;
+	const char *path;
+	uint64_t last_ns;
+} g_trace;
+
+static int trace_open(const char *path)
+{
+	g_trace.f = fopen(path, "we");
+	if (!g_trace.f) {
+		log_error("Cannot create trace %s: %m\n", path);
+		return -errno;
+	}
+	setvbuf(g_trace.f, NULL, _IOFBF, 1 << 20);
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), g_trace.f);
+	g_trace.path = path;
+	g_trace.last_ns = now_ns();
+	return 0;
+}
+
+/* Log batch[] of @dev, about to be written */
+static void trace_batch(struct uhid_dev *dev)
+{
+	unsigned char rec[10 + 2 + UHID_REPORT_MAX], *p;
+	uint64_t now = now_ns(), delta = now - g_trace.last_ns;
+	int idx = 0;
+
+	while (devs[idx] != dev)
+		idx++;
+	g_trace.last_ns = now;
+	for (int i = 0; i < dev->batch_len; i++, delta = 0) {
+		p = rec;
+		do {
+			*p++ = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+			delta >>= 7;
+		} while (delta);
+		*p++ = idx;
+		*p++ = dev->batch[i].size;
+		memcpy(p, dev->batch[i].data, dev->batch[i].size);
+		fwrite(rec, 1, p + dev->batch[i].size - rec, g_trace.f);
+	}
+}
+
+static void trace_close(void)
+{
+	if (!g_trace.f)
+		return;
+	if (fclose(g_trace.f))
+		log_error("Cannot write trace %s: %m\n", g_trace.path);
+	g_trace.f = NULL;
+}
+#endif /* UHID_KBD_LIB */
+
+static int uhid_flush(struct uhid_dev *dev)
+{
+	int ret;
+
+#ifdef UHID_IO_URING
+	if (dev->ring && dev->ring_writes)
+		return 0;	/* the queued batch is still on its way */
+	if (dev->ring && dev->ring_err) {
+		/* An earlier batch failed: report that, this one still goes out */
+		ret = dev->ring_err;
+		dev->ring_err = 0;
+		uhid_flush(dev);
+		return ret;
+	}
+#endif
+#ifndef UHID_KBD_LIB
+	if (g_trace.f && dev->batch_len)
+		trace_batch(dev);
+#endif
+	/* A sink, see "Microbenchmarks", only counts what it would write */
+	if (dev->fd < 0) {
+		metrics_sent(dev->batch, dev->batch_len);
+		dev->batch_len = 0;
+		return 0;
+	}
+#ifndef UHID_KBD_LIB
+	if (g_writer)
+		return dev->batch_len ? writer_push(g_writer, dev) : 0;
+#endif
+#ifdef UHID_IO_URING
+	if (dev->ring && dev->input2)
+		return dev->batch_len ? uring_flush(dev) : 0;
+#endif
+#ifndef UHID_KBD_LIB
+	if (g_nonblock)
+		return out_flush(dev);
+#endif
+	ret = uhid_write_reports(dev, dev->batch, dev->batch_iov, dev->batch_len);
+	dev->batch_len = 0;
+	return ret < 0 ? ret : 0;
+}
+
+/* Make room for one more report in batch[] of @dev */
+static int uhid_reserve(struct uhid_dev *dev)
+{
+	int ret = 0;
+
+	if (dev->batch_len == UHID_BATCH_MAX)
+		ret = uhid_flush(dev);
+#ifdef UHID_IO_URING
+	if (!ret && dev->ring_writes)
+		ret = uring_wait_writes(dev);
+#endif
+	/* A failed flush may leave batch[] full, never queue past its end */
+	if (!ret && dev->batch_len == UHID_BATCH_MAX)
+		ret = -ENOBUFS;
+	return ret;
+}
+
+/* Queue a copy of @rep, flushing right away when batching is off */
+static int uhid_submit(struct uhid_dev *dev, const struct uhid_report *rep)
+{
+	size_t len = UHID_REPORT_LEN(rep);
+	int n;
+
+	n = uhid_reserve(dev);
+	if (n)
+		return n;
+
+	n = dev->batch_len++;
+	memcpy(&dev->batch[n], rep, len);
+	dev->batch_iov[n].iov_base = &dev->batch[n];
+	dev->batch_iov[n].iov_len = len;
+
+	if (!g_batch)
+		return uhid_flush(dev);
+	return 0;
+}
+
+/*
+ * Macros
+ * A macro is compiled once, from the command lines of --macros FILE, into
+ * the very queue entries sched_submit() would produce: a flat array of
+ * encoded reports, each with the gap it needs after its predecessor.
+ * Playing it submits that array as is, without translating anything, so
+ * a replay costs a copy per report into the batch. See macro_load().
+ */
+#define MACRO_MAX 64
+
+struct macro {
+	char name[32];
+	unsigned char trig_usage;	/* escape sequence key that plays it, 0 = none */
+	unsigned char trig_mods;
+	struct paced_report *seq;
+	size_t len, cap;
+};
+
+#ifndef UHID_KBD_LIB
+static struct macro macros[MACRO_MAX];
+static int n_macros;
+#endif
+
+/* Record a report submitted while @dev compiles a macro */
+static int macro_append(struct uhid_dev *dev, const struct uhid_report *rep, uint64_t gap_ns)
+{
+	struct macro *m = dev->capture;
+	struct paced_report *p;
+
+	if (m->len == m->cap) {
+		size_t cap = m->cap ? m->cap * 2 : 64;
+
+		p = realloc(m->seq, cap * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		m->seq = p;
+		m->cap = cap;
+	}
+	p = &m->seq[m->len++];
+	memcpy(&p->rep, rep, UHID_REPORT_LEN(rep));
+	p->gap_ns = gap_ns + dev->capture_delay_ns;
+	dev->capture_delay_ns = 0;
+	return 0;
+}
+
+static inline unsigned int sched_len(const struct uhid_dev *dev)
+{
+	return dev->sched_tail - dev->sched_head;
+}
+
+static inline unsigned int sched_room(const struct uhid_dev *dev)
+{
+	return SCHED_MAX - sched_len(dev);
+}
+
+static inline uint64_t sched_due(const struct uhid_dev *dev, uint64_t gap_ns)
+{
+	return dev->sched_last_ns + (gap_ns > g_rate_gap_ns ? gap_ns : g_rate_gap_ns);
+}
+
+#ifndef UHID_KBD_LIB
+static int sched_init(struct uhid_dev *dev)
+{
+	dev->sched_q = calloc(SCHED_MAX, sizeof(*dev->sched_q));
+	if (!dev->sched_q) {
+		log_error("Cannot allocate pacing queue: %m\n");
+		return -ENOMEM;
+	}
+	dev->sched_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (dev->sched_tfd < 0) {
+		log_error("Cannot create timerfd: %m\n");
+		return -errno;
+	}
+	return 0;
+}
+#endif
+
+static void sched_arm(struct uhid_dev *dev)
+{
+	struct itimerspec its = { 0 };
+	uint64_t due;
+
+	if (sched_len(dev)) {
+		due = dev->held ? dev->open_deadline :
+			sched_due(dev, dev->sched_q[dev->sched_head & (SCHED_MAX - 1)].gap_ns);
+		/* 0 would disarm the timer */
+		its.it_value.tv_sec = due / 1000000000ull;
+		its.it_value.tv_nsec = due % 1000000000ull ? : 1;
+	}
+	timerfd_settime(dev->sched_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Duplicate reports
+ * A HID input report carries the whole state of its report ID, so one that
+ * matches the previous report with the same ID tells the host nothing:
+ * a release of a key that was not pressed, a consumer release after a
+ * release, a binary record sent twice. sched_submit() drops those, which
+ * saves a write and a report parse in the kernel each, and counts them in
+ * dup_reports. The comparison is against what was last submitted, whether
+ * it came from a template, a macro or a binary record; macros being
+ * compiled record every report.
+ *
+ * report_resend() forgets the last reports so the next ones go out no
+ * matter what, and sends the current state again. Losing the state is
+ * what a (re)starting or newly opened HID driver does, so uhid events
+ * UHID_START and UHID_OPEN forget it too. --no-dedup sends everything.
+ */
+static bool g_dedup = true;
+
+/* True if @rep matches the last report with its ID */
+static bool report_unchanged(const struct uhid_dev *dev, const struct uhid_report *rep)
+{
+	if (rep->data[0] >= REPORT_ID_COUNT)
+		return false;
+	return !memcmp(dev->last_sent[rep->data[0]], rep->data, rep->size) && !mouse_moves(rep);
+}
+
+/* @rep was queued or submitted, so it is what the host ends up with */
+static void report_remember(struct uhid_dev *dev, const struct uhid_report *rep)
+{
+	if (rep->data[0] < REPORT_ID_COUNT)
+		memcpy(dev->last_sent[rep->data[0]], rep->data, rep->size);
+}
+
+static void report_forget(struct uhid_dev *dev)
+{
+	memset(dev->last_sent, 0, sizeof(dev->last_sent));
+}
+
+static int sched_queue(struct uhid_dev *dev, const struct uhid_report *rep, uint64_t gap_ns)
+{
+	struct paced_report *p;
+	uint64_t now;
+
+	if (!g_pacing)
+		return uhid_submit(dev, rep);
+
+	now = now_ns();
+	if (!sched_len(dev) && !dev->held && now >= sched_due(dev, gap_ns)) {
+		dev->sched_last_ns = now;
+		return uhid_submit(dev, rep);
+	}
+	if (dev->held && !dev->open_deadline)
+		dev->open_deadline = now + g_wait_open_ns;
+
+	if (!sched_room(dev)) {
+		metric_add(metrics.sched_dropped, 1);
+		log_warn("Pacing queue full, dropping report\n");
+		return -ENOBUFS;
+	}
+	p = &dev->sched_q[dev->sched_tail++ & (SCHED_MAX - 1)];
+	memcpy(&p->rep, rep, UHID_REPORT_LEN(rep));
+	p->gap_ns = gap_ns;
+	if (sched_len(dev) == 1)
+		sched_arm(dev);
+	return 0;
+}
+
+static int sched_submit(struct uhid_dev *dev, const struct uhid_report *rep, uint64_t gap_ns)
+{
+	int ret;
+
+	if (dev->capture)
+		return macro_append(dev, rep, gap_ns);
+	if (g_dedup && report_unchanged(dev, rep)) {
+		dev->dup_reports++;
+		return 0;
+	}
+	/* A report that never got out must not suppress the next one */
+	ret = sched_queue(dev, rep, gap_ns);
+	if (!ret && g_dedup)
+		report_remember(dev, rep);
+	return ret;
+}
+
+#ifndef UHID_KBD_LIB
+/* Submit and flush every queued report that is due; called on timer expiry */
+static int sched_run(struct uhid_dev *dev)
+{
+	uint64_t expirations, now = now_ns();
+	bool sent = false;
+
+	if (read(dev->sched_tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		log_warn("Cannot read timerfd: %m\n");
+	if (dev->held) {
+		if (now < dev->open_deadline) {
+			sched_arm(dev);
+			return 0;
+		}
+		log_warn("No UHID_OPEN for %s within %" PRIu64 " ms, sending anyway\n",
+			 dev->name, g_wait_open_ns / 1000000);
+		dev->held = false;
+		dev->open_deadline = 0;
+	}
+
+	while (sched_len(dev)) {
+		struct paced_report *p = &dev->sched_q[dev->sched_head & (SCHED_MAX - 1)];
+
+		if (now < sched_due(dev, p->gap_ns))
+			break;
+		uhid_submit(dev, &p->rep);
+		dev->sched_last_ns = now;
+		dev->sched_head++;
+		sent = true;
+	}
+	sched_arm(dev);
+
+	return sent ? uhid_flush(dev) : 0;
+}
+#endif
+
+static const struct uhid_event create_ev = {
+	.type = UHID_CREATE,
+	.u.create = {
+		.name = "test-uhid-device",
+		.rd_data = rdesc,
+		.rd_size = sizeof(rdesc),
+		.bus = BUS_USB,
+		.vendor = 0x15d9,
+		.product = 0x0a37,
+		.version = 0,
+		.country = 0,
+	},
+};
+
+static const struct uhid_event destroy_ev = {
+	.type = UHID_DESTROY,
+};
+
+static int create(struct uhid_dev *dev)
+{
+	unsigned char rdesc_full[sizeof(rdesc) + sizeof(rdesc_nkro) + sizeof(rdesc_pointer)];
+	struct uhid_event ev = create_ev;
+	size_t len = sizeof(rdesc);
+
+	if (dev->nkro || dev->pointer) {
+		memcpy(rdesc_full, rdesc, sizeof(rdesc));
+		if (dev->nkro) {
+			memcpy(rdesc_full + len, rdesc_nkro, sizeof(rdesc_nkro));
+			len += sizeof(rdesc_nkro);
+		}
+		if (dev->pointer) {
+			memcpy(rdesc_full + len, rdesc_pointer, sizeof(rdesc_pointer));
+			len += sizeof(rdesc_pointer);
+		}
+		ev.u.create.rd_data = rdesc_full;
+		ev.u.create.rd_size = len;
+	}
+	memcpy(ev.u.create.name, dev->name, sizeof(ev.u.create.name));
+	ev.u.create.vendor = dev->vendor;
+	ev.u.create.product = dev->product;
+	return uhid_write(dev->fd, &ev, sizeof(ev));
+}
+
+static void destroy(struct uhid_dev *dev)
+{
+	uhid_write(dev->fd, &destroy_ev, sizeof(destroy_ev));
+}
+
+/*
+ * Open the uhid cdev @path, adding @flags to O_RDWR, and create @dev on
+ * it; for the program's devices and the library's keyboards alike
+ */
+static int dev_open(struct uhid_dev *dev, const char *path, int flags)
+{
+	int ret;
+
+	dev->fd = open(path, O_RDWR | O_CLOEXEC | flags);
+	if (dev->fd < 0) {
+		ret = -errno;
+		log_error("Cannot open uhid-cdev %s: %m\n", path);
+		return ret;
+	}
+	log_info("Create uhid device %s (%04x:%04x)\n", dev->name, dev->vendor, dev->product);
+	ret = create(dev);
+	if (ret) {
+		close(dev->fd);
+		dev->fd = -1;
+		return ret;
+	}
+	dev->created = true;
+	return 0;
+}
+
+/* Destroy @dev if it was created and close its cdev */
+static void dev_close(struct uhid_dev *dev)
+{
+	if (dev->created) {
+		log_info("Destroy uhid device %s\n", dev->name);
+		destroy(dev);
+		dev->created = false;
+	}
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
+
+/*
+ * Host LEDs
+ * The host sets the lock LEDs through output report ID 1, one bit per
+ * LED in the order of the LED_* codes of <linux/input.h>. Kernels before
+ * 3.11 sent single EV_LED events as UHID_OUTPUT_EV instead. The state is
+ * kept per device for the translator, which then knows what Caps Lock
+ * does to letters, and for control clients that asked to follow it.
+ */
+static const char *const led_names[] = { "num", "caps", "scroll", "compose", "kana" };
+
+#ifndef UHID_KBD_LIB
+static void ctl_leds_changed(struct uhid_dev *dev);
+#endif
+
+/* "num caps" for the set bits of @leds, "none" if there are none */
+static const char *leds_str(__u8 leds, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (size_t i = 0; i < ARRAY_SIZE(led_names) && len < size; i++) {
+		if (leds & (1 << i))
+			len += snprintf(buf + len, size - len, "%s%s", len ? " " : "", led_names[i]);
+	}
+	return buf[0] ? buf : "none";
+}
+
+static void leds_update(struct uhid_dev *dev, __u8 leds)
+{
+	char buf[64];
+
+	if (dev->leds_known && dev->leds == leds)
+		return;
+	dev->leds = leds;
+	dev->leds_known = true;
+	log_info("LEDs of %s: %s\n", dev->name, leds_str(leds, buf, sizeof(buf)));
+#ifndef UHID_KBD_LIB
+	ctl_leds_changed(dev);
+#endif
+}
+
+/* Parse an output report in place; only report ID 1 has any */
+static void handle_output(struct uhid_dev *dev, const struct uhid_event *ev)
+{
+	const struct uhid_output_req *out = &ev->u.output;
+
+	if (out->rtype != UHID_OUTPUT_REPORT || out->size < 2 || out->data[0] != 0x01)
+		return;
+	leds_update(dev, out->data[1] & ((1 << ARRAY_SIZE(led_names)) - 1));
+}
+
+static void handle_output_ev(struct uhid_dev *dev, const struct uhid_event *ev)
+{
+	const struct uhid_output_ev_req *out = &ev->u.output_ev;
+
+	if (out->type != EV_LED || out->code >= ARRAY_SIZE(led_names))
+		return;
+	leds_update(dev, out->value ? dev->leds | (1 << out->code) :
+				      dev->leds & ~(1 << out->code));
+}
+
+/* Handle the result @ret of reading @ev from the uhid cdev of @dev */
+static int event_process(struct uhid_dev *dev, struct uhid_event *ev, ssize_t ret)
+{
+	if (ret == 0) {
+		log_error("Read HUP on uhid-cdev of %s\n", dev->name);
+		return -EFAULT;
+	} else if (ret < 0) {
+		log_error("Cannot read uhid-cdev of %s: %m\n", dev->name);
+		return -errno;
+	} else if (ret != sizeof(*ev)) {
+		log_error("Invalid size read from uhid-dev: %zd != %zu\n",
+			ret, sizeof(*ev));
+		return -EFAULT;
+	}
+
+	switch (ev->type) {
+	case UHID_START:
+    log_info("UHID_START from %s\n", dev->name);
+		dev->started = true;
+		report_forget(dev);
+		break;
+	case UHID_STOP:
+    log_info("UHID_STOP from %s\n", dev->name);
+		dev->started = false;
+		break;
+	case UHID_OPEN:
+    log_info("UHID_OPEN from %s\n", dev->name);
+		report_forget(dev);
+		if (dev->held) {
+			dev->held = false;
+			dev->open_deadline = 0;
+			sched_arm(dev);
+		}
+		break;
+	case UHID_CLOSE:
+    log_info("UHID_CLOSE from %s\n", dev->name);
+		dev->held = g_wait_open_ns != 0;
+		break;
+	case UHID_OUTPUT:
+    log_debug("UHID_OUTPUT from %s\n", dev->name);
+		handle_output(dev, ev);
+		break;
+	case UHID_OUTPUT_EV:
+		log_debug("UHID_OUTPUT_EV from %s\n", dev->name);
+		handle_output_ev(dev, ev);
+		break;
+	default:
+		log_warn("Invalid event from uhid-dev: %u\n", ev->type);
+	}
+
+	return 0;
+}
+
+static int event(struct uhid_dev *dev)
+{
+	struct uhid_event ev;
+
+	/* Anything shorter than a whole event is rejected unparsed */
+	return event_process(dev, &ev, read(dev->fd, &ev, sizeof(ev)));
+}
+
+#ifndef UHID_KBD_LIB
+/* Handle pending uhid events for up to @timeout_ms */
+static int uhid_service(struct uhid_dev *dev, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	int ret;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+	if (ret > 0 && (pfd.revents & POLLIN))
+		return event(dev);
+	return 0;
+}
+
+/* Run paced reports and uhid events until at least @room queue slots are free */
+static int sched_wait_room(struct uhid_dev *dev, unsigned int room)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = dev->sched_tfd, .events = POLLIN },
+		{ .fd = dev->fd, .events = POLLIN },
+	};
+	int ret;
+
+	while (sched_room(dev) < room) {
+		ret = poll(pfds, 2, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (pfds[0].revents & POLLIN) {
+			ret = sched_run(dev);
+			if (ret)
+				return ret;
+		}
+		if (pfds[1].revents & POLLIN) {
+			ret = event(dev);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Wait up to @timeout_ms for the kernel to start the device */
+static int wait_for_start(struct uhid_dev *dev, int timeout_ms)
+{
+	uint64_t deadline = now_ns() + timeout_ms * 1000000ull;
+	int ret;
+
+	while (!dev->started) {
+		if (now_ns() >= deadline) {
+			log_error("No UHID_START within %d ms\n", timeout_ms);
+			return -ETIMEDOUT;
+		}
+		ret = uhid_service(dev, 100);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+#endif
+
+/* Send the keyboard report, @gap_ns after the previous one when pacing */
+static int send_event(struct uhid_dev *dev, uint64_t gap_ns)
+{
+    if (dev->nkro) {
+        dev->nkro_report.data[1] = dev->modifier_keys;
+        memcpy(&dev->nkro_report.data[2], dev->key_bits, NKRO_BITMAP_BYTES);
+        log_debug("HID Report (ID=3): modifiers=0x%02x, %d keys pressed\n",
+                  dev->modifier_keys, dev->num_keys_pressed);
+        return sched_submit(dev, &dev->nkro_report, gap_ns);
+    }
+
+    dev->kbd_report.data[1] = dev->modifier_keys;  /* Modifier keys bitfield */
+    /* Unused key_codes slots are always zero, so no stale keycodes on key-up */
+    memcpy(&dev->kbd_report.data[3], dev->key_codes, sizeof(dev->key_codes));
+
+    /* Debug output for all HID reports */
+    if (g_log_level >= LVL_DEBUG) {
+        if (dev->num_keys_pressed > 0) {
+            char keys[6 * 5 + 1];
+            int len = 0;
+
+            for (int i = 0; i < 6; i++) {
+                if (dev->key_codes[i] != 0)
+                    len += sprintf(keys + len, "0x%02x ", dev->key_codes[i]);
+            }
+            keys[len] = '\0';
+            log_msg(LVL_DEBUG, "HID Report (ID=1): modifiers=0x%02x, keys=[%s]\n",
+                    dev->modifier_keys, keys);
+        } else {
+            log_msg(LVL_DEBUG, "HID Report: modifiers=0x%02x, keys=[ ] (no keys pressed)\n",
+                    dev->modifier_keys);
+        }
+    }
+
+	return sched_submit(dev, &dev->kbd_report, gap_ns);
+}
+
+/* Send a Consumer Control report with @usage pressed, or none if 0 */
+static int send_consumer_event(struct uhid_dev *dev, unsigned short usage, uint64_t gap_ns)
+{
+    dev->consumer_report.data[1] = usage & 0xff;
+    dev->consumer_report.data[2] = usage >> 8;
+
+    log_debug("Consumer Report (ID=2): usage=0x%03x\n", usage);
+
+    return sched_submit(dev, &dev->consumer_report, gap_ns);
+}
+
+#ifndef UHID_KBD_LIB
+static int pointer_report(struct uhid_dev *dev, uint64_t gap_ns);
+
+/* Send the current key, consumer and pointer state, even if it was sent before */
+static int report_resend(struct uhid_dev *dev)
+{
+	int ret;
+
+	report_forget(dev);
+	ret = send_event(dev, 0);
+	if (!ret)
+		ret = sched_submit(dev, &dev->consumer_report, 0);
+	if (!ret && dev->pointer)
+		ret = pointer_report(dev, 0);
+	return ret;
+}
+#endif
+
+/*
+ * ASCII to HID translation
+ * One entry per byte value: keyboard usage, the modifiers it needs on a US
+ * layout and a display name for the debug output. Bytes without an entry
+ * have usage 0 and are reported as unknown. Translating a character is a
+ * single indexed load.
+ */
+struct ascii_key {
+	unsigned char usage;
+	unsigned char mods;
+	unsigned short consumer;	/* consumer usage instead of a key */
+	const char *name;
+};
+
+#define KEY(u, n)	{ (u), 0, 0, (n) }
+#define SHIFTED(u, n)	{ (u), HID_MOD_LSHIFT, 0, (n) }
+#define CONSUMER(u, n)	{ 0, 0, (u), (n) }
+/* Plain and shifted character sharing one key */
+#define PAIR(c, sc, u, n) [c] = KEY(u, n), [sc] = SHIFTED(u, n)
+#define LETTER(c) PAIR(c, (c) - 'a' + 'A', HID_A + ((c) - 'a'), "LETTER")
+
+static const struct ascii_key ascii_keys[256] = {
+	LETTER('a'), LETTER('b'), LETTER('c'), LETTER('d'), LETTER('e'),
+	LETTER('f'), LETTER('g'), LETTER('h'), LETTER('i'), LETTER('j'),
+	LETTER('k'), LETTER('l'), LETTER('m'), LETTER('n'), LETTER('o'),
+	LETTER('p'), LETTER('q'), LETTER('r'), LETTER('s'), LETTER('t'),
+	LETTER('u'), LETTER('v'), LETTER('w'), LETTER('x'), LETTER('y'),
+	LETTER('z'),
+
+	PAIR('1', '!', HID_1 + 0, "NUMBER"),
+	PAIR('2', '@', HID_1 + 1, "NUMBER"),
+	PAIR('3', '#', HID_1 + 2, "NUMBER"),
+	PAIR('4', '$', HID_1 + 3, "NUMBER"),
+	PAIR('5', '%', HID_1 + 4, "NUMBER"),
+	PAIR('6', '^', HID_1 + 5, "NUMBER"),
+	PAIR('7', '&', HID_1 + 6, "NUMBER"),
+	PAIR('8', '*', HID_1 + 7, "NUMBER"),
+	PAIR('9', '(', HID_1 + 8, "NUMBER"),
+	PAIR('0', ')', HID_0, "NUMBER"),
+
+	PAIR('-', '_', 0x2d, "SYMBOL"),		/* HID_MINUS */
+	PAIR('=', '+', 0x2e, "SYMBOL"),		/* HID_EQUAL */
+	['['] = KEY(0x2f, "SYMBOL"),		/* HID_LEFTBRACE */
+	[']'] = KEY(0x30, "SYMBOL"),		/* HID_RIGHTBRACE */
+	/* '{' and '}' have always been the volume keys here */
+	['{'] = CONSUMER(CC_VOLUME_DOWN, "VOLUME_DOWN"),
+	['}'] = CONSUMER(CC_VOLUME_UP, "VOLUME_UP"),
+	PAIR('\\', '|', 0x31, "SYMBOL"),	/* HID_BACKSLASH */
+	PAIR(';', ':', 0x33, "SYMBOL"),		/* HID_SEMICOLON */
+	PAIR('\'', '"', 0x34, "SYMBOL"),	/* HID_APOSTROPHE */
+	PAIR('`', '~', 0x35, "SYMBOL"),		/* HID_GRAVE */
+	PAIR(',', '<', 0x36, "SYMBOL"),		/* HID_COMMA */
+	PAIR('.', '>', 0x37, "SYMBOL"),		/* HID_DOT */
+	PAIR('/', '?', 0x38, "SYMBOL"),		/* HID_SLASH */
+
+	[' ']  = KEY(HID_KEY_SPACE, "SPACE"),
+	['\n'] = KEY(HID_KEY_ENTER, "ENTER"),
+	['\r'] = KEY(HID_KEY_ENTER, "ENTER"),
+	['\b'] = KEY(HID_KEY_BACKSPACE, "BACKSPACE"),
+	[0x7f] = KEY(HID_KEY_BACKSPACE, "BACKSPACE"),
+	['\t'] = KEY(HID_TAB, "TAB"),
+	[27]   = KEY(HID_KEY_ESC, "ESC"),
+};
+
+/*
+ * Keyboard layouts
+ * ascii_keys[] assumes the host has a US layout. --layout=FILE describes
+ * the host layout instead, one character per line:
+ *
+ *   CHAR  [MOD+]KEY  [[MOD+]DEADKEY]
+ *
+ * CHAR is one UTF-8 character or U+XXXX. KEY takes the syntax of the key
+ * control command: a character as on a US keyboard, a name such as enter,
+ * or 0xUSAGE. DEADKEY is tapped first for characters that are composed
+ * with a dead key. A line that starts with "#" is a comment, so "#" itself
+ * is U+0023. Characters the file leaves out are unknown, except for space
+ * and the control characters of ascii_keys[].
+ *
+ * The file becomes a reverse table from code point to keys: a direct
+ * array for the Basic Multilingual Plane and, for the few characters
+ * beyond it, a perfect hash built at load time. A lookup is one load in
+ * the former and two in the latter, never a search.
+ */
+struct layout_key {
+	__u8 usage;		/* 0 if not in the layout */
+	__u8 mods;
+	__u8 dead_usage;	/* dead key to tap first, 0 for none */
+	__u8 dead_mods;
+};
+
+struct layout_astral {
+	uint32_t cp;		/* 0 for an empty slot */
+	struct layout_key key;
+};
+
+static struct {
+	struct layout_key *bmp;		/* 0x10000 entries, NULL without --layout */
+	struct layout_astral *astral;	/* 1 << astral_bits slots */
+	uint16_t *disp;			/* 1 << disp_bits bucket displacements */
+	unsigned int astral_bits;
+	unsigned int disp_bits;
+} g_layout;
+
+/* murmur3 finalizer */
+static inline uint32_t layout_mix(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	return x ^ (x >> 16);
+}
+
+static inline unsigned int layout_bucket(uint32_t cp)
+{
+	return layout_mix(cp) >> (32 - g_layout.disp_bits);
+}
+
+static inline unsigned int layout_slot(uint32_t cp, uint32_t disp)
+{
+	return layout_mix(cp * 0x9e3779b1 + disp) >> (32 - g_layout.astral_bits);
+}
+
+static const struct layout_key *layout_lookup(uint32_t cp)
+{
+	const struct layout_astral *a;
+
+	if (cp < 0x10000)
+		return g_layout.bmp[cp].usage ? &g_layout.bmp[cp] : NULL;
+	if (!g_layout.astral)
+		return NULL;
+	a = &g_layout.astral[layout_slot(cp, g_layout.disp[layout_bucket(cp)])];
+	return a->cp == cp ? &a->key : NULL;
+}
+
+/* Smallest code point of a UTF-8 sequence of each length, to reject overlong ones */
+static const uint32_t utf8_min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+#define UTF8_INVALID 0xfffd	/* replacement character */
+
+/*
+ * Terminal escape sequences
+ * Keys the terminal cannot send as a single byte arrive as CSI (ESC [
+ * params final) or SS3 (ESC O final) sequences. They are decoded by a small
+ * state machine in process_input() that keeps its state in a struct
+ * esc_parser between reads, so a sequence may be split anywhere. Every byte
+ * costs one state transition; the final byte selects the key through one of
+ * the tables below. A lone ESC is only known to be the Escape key once
+ * g_esc_timeout_ns passes without a follow-up byte.
+ */
+struct esc_key {
+	unsigned char usage;
+	unsigned short consumer;	/* consumer usage instead of a key */
+	const char *name;
+};
+
+#define ESC_KEY(u, n)	{ (u), 0, (n) }
+#define ESC_FKEY(i)	{ HID_KEY_F1 + (i) - 1, 0, "F" #i }
+
+/* CSI and SS3 sequences identified by their final byte */
+static const struct esc_key esc_final_keys[128] = {
+	['A'] = ESC_KEY(HID_KEY_UP, "UP_ARROW"),
+	['B'] = ESC_KEY(HID_KEY_DOWN, "DOWN_ARROW"),
+	['C'] = ESC_KEY(HID_KEY_RIGHT, "RIGHT_ARROW"),
+	['D'] = ESC_KEY(HID_KEY_LEFT, "LEFT_ARROW"),
+	['H'] = ESC_KEY(HID_KEY_HOME, "HOME"),
+	['F'] = ESC_KEY(HID_KEY_END, "END"),
+	['P'] = ESC_FKEY(1),
+	['Q'] = ESC_FKEY(2),
+	['R'] = ESC_FKEY(3),
+	['S'] = ESC_FKEY(4),
+	['M'] = ESC_KEY(HID_KEY_ENTER, "ENTER"),	/* keypad Enter, SS3 */
+};
+
+/* CSI <n> ~ sequences (vt220 style) */
+static const struct esc_key esc_tilde_keys[25] = {
+	[1]  = ESC_KEY(HID_KEY_HOME, "HOME"),
+	[2]  = ESC_KEY(HID_KEY_INSERT, "INSERT"),
+	[3]  = ESC_KEY(HID_KEY_DELETE, "DELETE"),
+	[4]  = ESC_KEY(HID_KEY_END, "END"),
+	[5]  = ESC_KEY(HID_KEY_PAGEUP, "PAGE_UP"),
+	[6]  = ESC_KEY(HID_KEY_PAGEDOWN, "PAGE_DOWN"),
+	[7]  = ESC_KEY(HID_KEY_HOME, "HOME"),
+	[8]  = ESC_KEY(HID_KEY_END, "END"),
+	[11] = ESC_FKEY(1),
+	[12] = ESC_FKEY(2),
+	[13] = ESC_FKEY(3),
+	[14] = ESC_FKEY(4),
+	[15] = ESC_FKEY(5),
+	[17] = ESC_FKEY(6),
+	[18] = ESC_FKEY(7),
+	/* ESC [ 19 ~ (F8) has always meant Play/Pause here */
+	[19] = { 0, CC_PLAY_PAUSE, "PLAY_PAUSE" },
+	[20] = ESC_FKEY(9),
+	[21] = ESC_FKEY(10),
+	[23] = ESC_FKEY(11),
+	[24] = ESC_FKEY(12),
+};
+
+/* xterm modifier parameter (value - 1) to HID modifier bits */
+static const unsigned char esc_mods[16] = {
+	0,
+	HID_MOD_LSHIFT,
+	HID_MOD_LALT,
+	HID_MOD_LSHIFT | HID_MOD_LALT,
+	HID_MOD_LCTRL,
+	HID_MOD_LCTRL | HID_MOD_LSHIFT,
+	HID_MOD_LCTRL | HID_MOD_LALT,
+	HID_MOD_LCTRL | HID_MOD_LSHIFT | HID_MOD_LALT,
+	HID_MOD_LGUI,
+	HID_MOD_LGUI | HID_MOD_LSHIFT,
+	HID_MOD_LGUI | HID_MOD_LALT,
+	HID_MOD_LGUI | HID_MOD_LSHIFT | HID_MOD_LALT,
+	HID_MOD_LGUI | HID_MOD_LCTRL,
+	HID_MOD_LGUI | HID_MOD_LCTRL | HID_MOD_LSHIFT,
+	HID_MOD_LGUI | HID_MOD_LCTRL | HID_MOD_LALT,
+	HID_MOD_LGUI | HID_MOD_LCTRL | HID_MOD_LSHIFT | HID_MOD_LALT,
+};
+
+static inline bool key_down(const struct uhid_dev *dev, unsigned char usage)
+{
+	return dev->key_bits[usage >> 3] & (1u << (usage & 7));
+}
+
+/* Mark a key pressed */
+static void add_key(struct uhid_dev *dev, unsigned char hid_code)
+{
+	if (key_down(dev, hid_code))
+		return;  /* Already pressed */
+	dev->key_bits[hid_code >> 3] |= 1u << (hid_code & 7);
+	dev->num_keys_pressed++;
+
+	/* Report ID 1 has room for 6 keys, the rest only go out as NKRO */
+	if (dev->num_key_codes < 6) {
+		dev->key_codes[dev->num_key_codes++] = hid_code;
+		dev->key_slot[hid_code] = dev->num_key_codes;
+	}
+}
+
+/* Mark a key released */
+static void remove_key(struct uhid_dev *dev, unsigned char hid_code)
+{
+	int slot = dev->key_slot[hid_code] - 1, last;
+
+	if (!key_down(dev, hid_code))
+		return;
+	dev->key_bits[hid_code >> 3] &= ~(1u << (hid_code & 7));
+	dev->num_keys_pressed--;
+
+	if (slot < 0)
+		return;
+	/* Array order carries no meaning: move the last key into the hole */
+	last = --dev->num_key_codes;
+	dev->key_codes[slot] = dev->key_codes[last];
+	dev->key_slot[dev->key_codes[slot]] = slot + 1;
+	/* Clear the now-unused last slot to avoid stale values */
+	dev->key_codes[last] = 0;
+	dev->key_slot[hid_code] = 0;
+}
+
+/* Clear all pressed keys */
+static void clear_keys(struct uhid_dev *dev)
+{
+	memset(dev->key_bits, 0, sizeof(dev->key_bits));
+	memset(dev->key_codes, 0, sizeof(dev->key_codes));
+	memset(dev->key_slot, 0, sizeof(dev->key_slot));
+	dev->num_keys_pressed = 0;
+	dev->num_key_codes = 0;
+	dev->modifier_keys = 0;
+}
+
+/*
+ * Pointer motion
+ * Motion is coalesced per frame: the first move after an idle spell
+ * starts a frame of POINTER_FRAME_NS, during which relative moves add up
+ * and absolute positions replace each other, and the first keys_flush()
+ * after it ends sends what piled up. The main loop wakes up for that as
+ * it does for a pending ESC. A motion stream thus costs one report per
+ * frame however many updates it has and however they are split across
+ * control packets. A button change sends the motion before it first, and
+ * goes out in whichever report moved last; so does a relative move after
+ * an absolute one and the other way round. While a macro is compiled
+ * every move is a report of its own so that delays keep their place. The
+ * library has no clock of its own, each uhid_kbd_flush() ends the frame.
+ */
+#define POINTER_MOVE_MAX (1 << 24)	/* pending per axis, far beyond a frame */
+#define POINTER_FRAME_NS (8 * 1000000ull)	/* 125 Hz, a USB mouse's default polling */
+
+#ifndef UHID_KBD_LIB
+static const struct {
+	const char *name;
+	__u8 mask;
+} pointer_buttons[] = {
+	{ "left", 0x01 }, { "right", 0x02 }, { "middle", 0x04 },
+	{ "back", 0x08 }, { "forward", 0x10 },
+};
+#endif
+
+/* Send the buttons with the current position, or without motion */
+static int pointer_report(struct uhid_dev *dev, uint64_t gap_ns)
+{
+	struct uhid_report *rep = dev->pointer_abs ? &dev->abs_report : &dev->mouse_report;
+
+	rep->data[1] = dev->buttons;
+	if (dev->pointer_abs) {
+		rep->data[2] = dev->abs_x & 0xff;
+		rep->data[3] = dev->abs_x >> 8;
+		rep->data[4] = dev->abs_y & 0xff;
+		rep->data[5] = dev->abs_y >> 8;
+	} else {
+		memset(&rep->data[2], 0, 6);
+	}
+	log_debug("Pointer Report (ID=%d): buttons=0x%02x\n", rep->data[0], dev->buttons);
+	return sched_submit(dev, rep, gap_ns);
+}
+
+/* Send the motion of the frame */
+static int pointer_sync(struct uhid_dev *dev)
+{
+	struct uhid_report *rep = &dev->mouse_report;
+	int ret = 0;
+
+	while (!ret && (dev->move[0] || dev->move[1] || dev->move[2] || dev->move[3])) {
+		rep->data[1] = dev->buttons;
+		for (int a = 0; a < 4; a++) {
+			int max = a < 2 ? INT16_MAX : INT8_MAX;
+			int v = dev->move[a] > max ? max : dev->move[a] < -max ? -max : dev->move[a];
+
+			mouse_axis_set(rep, a, v);
+			dev->move[a] -= v;
+		}
+		log_debug("Pointer Report (ID=%d): buttons=0x%02x, move %d,%d\n", REPORT_ID_MOUSE,
+			  dev->buttons, mouse_axis(rep, 0), mouse_axis(rep, 1));
+		ret = sched_submit(dev, rep, 0);
+	}
+	if (!ret && dev->abs_pending) {
+		dev->abs_pending = false;
+		ret = pointer_report(dev, 0);
+	}
+	/* Motion that could not be sent is lost, or the frame would never end */
+	memset(dev->move, 0, sizeof(dev->move));
+	dev->abs_pending = false;
+	dev->frame_ns = 0;
+	return ret;
+}
+
+/* Motion is pending: start a frame unless one is running */
+static inline void pointer_frame(struct uhid_dev *dev)
+{
+	if (!dev->frame_ns)
+		dev->frame_ns = now_ns() + POINTER_FRAME_NS;
+}
+
+/* Move by @d: X, Y, wheel, pan */
+static int pointer_move(struct uhid_dev *dev, const int d[4])
+{
+	int ret = 0;
+
+	if (dev->abs_pending)
+		ret = pointer_sync(dev);
+	dev->pointer_abs = false;
+	for (int a = 0; !ret && a < 4; a++) {
+		if (abs(dev->move[a] + d[a]) > POINTER_MOVE_MAX)
+			ret = pointer_sync(dev);
+	}
+	if (ret)
+		return ret;
+	for (int a = 0; a < 4; a++)
+		dev->move[a] += d[a];
+	pointer_frame(dev);
+	return dev->capture ? pointer_sync(dev) : 0;
+}
+
+static int pointer_moveto(struct uhid_dev *dev, unsigned int x, unsigned int y)
+{
+	int ret = 0;
+
+	if (!dev->pointer_abs)
+		ret = pointer_sync(dev);
+	if (ret)
+		return ret;
+	dev->pointer_abs = true;
+	dev->abs_x = x;
+	dev->abs_y = y;
+	dev->abs_pending = true;
+	pointer_frame(dev);
+	return dev->capture ? pointer_sync(dev) : 0;
+}
+
+static int pointer_button(struct uhid_dev *dev, __u8 mask, bool down, uint64_t gap_ns)
+{
+	int ret = pointer_sync(dev);
+
+	if (ret)
+		return ret;
+	if (down)
+		dev->buttons |= mask;
+	else
+		dev->buttons &= ~mask;
+	return pointer_report(dev, gap_ns);
+}
+
+/*
+ * Chord coalescing (--coalesce)
+ * Consecutive taps that share their modifiers are pressed together in one
+ * report and released together in the next, as far as HID keeps them
+ * apart: no key twice, at most six in the boot array, and on an NKRO
+ * device only ascending usages since a bitmap has no order. hid-input
+ * reports the new keys of an array field in array order, so the host
+ * still sees the presses in typing order. Modifiers that the next chord
+ * needs as well stay down in between, so a run of capitals holds Shift
+ * throughout and "HELLO" takes 4 reports instead of 10.
+ *
+ * A chord is only ever pending inside one translation pass: keys_flush()
+ * ends it before the reports are written out.
+ */
+static bool g_coalesce = false;
+
+/* Send the pending chord and release it, keeping @next_mods if held */
+static int chord_end(struct uhid_dev *dev, unsigned char next_mods)
+{
+	int ret, err;
+
+	if (!dev->chord_len)
+		return 0;
+	ret = send_event(dev, 0);
+
+	for (int i = 0; i < dev->chord_len; i++)
+		remove_key(dev, dev->chord_keys[i]);
+	dev->chord_len = 0;
+	dev->modifier_keys &= next_mods | dev->held_mods;
+	err = send_event(dev, g_hold_ns);
+	return ret ? : err;
+}
+
+static int chord_add(struct uhid_dev *dev, unsigned char usage, unsigned char mods)
+{
+	int max = dev->nkro ? CHORD_MAX : 6, ret = 0;
+
+	mods |= dev->held_mods;
+	if (dev->chord_len &&
+	    (mods != dev->modifier_keys || key_down(dev, usage) || dev->chord_len == max ||
+	     (dev->nkro && usage < dev->chord_keys[dev->chord_len - 1])))
+		ret = chord_end(dev, mods);
+
+	dev->modifier_keys = mods;
+	add_key(dev, usage);
+	dev->chord_keys[dev->chord_len++] = usage;
+	return ret;
+}
+
+/*
+ * End any pending chord, and the pointer frame if it is over, and write
+ * out the reports. Like everything that sends, it carries on past a failed
+ * report so that the key state stays whole, and returns the first error.
+ */
+static int keys_flush(struct uhid_dev *dev)
+{
+	int ret = chord_end(dev, 0), err = 0;
+
+	if (dev->frame_ns && now_ns() >= dev->frame_ns)
+		err = pointer_sync(dev);
+	ret = ret ? : err;
+	err = uhid_flush(dev);
+	return ret ? : err;
+}
+
+/* Press and release one key, with whatever modifiers it needs */
+static int tap_key(struct uhid_dev *dev, unsigned char usage, unsigned char mods)
+{
+	int ret, err;
+
+	/* Typing a held key must not let go of it */
+	if (dev->holds[usage])
+		return 0;
+	if (g_coalesce)
+		return chord_add(dev, usage, mods);
+
+	dev->modifier_keys |= mods;
+	add_key(dev, usage);
+	ret = send_event(dev, 0);
+
+	remove_key(dev, usage);
+	dev->modifier_keys = (dev->modifier_keys & ~mods) | dev->held_mods;
+	err = send_event(dev, g_hold_ns);
+	return ret ? : err;
+}
+
+static int tap_consumer(struct uhid_dev *dev, unsigned short usage)
+{
+	/* Keys typed before this must not overtake it */
+	int ret = chord_end(dev, 0), err;
+
+	err = send_consumer_event(dev, usage, 0);
+	ret = ret ? : err;
+	err = send_consumer_event(dev, 0, g_hold_ns);
+	return ret ? : err;
+}
+
+#ifndef UHID_KBD_LIB
+/*
+ * Held keys
+ * "hold KEY MS" presses KEY and leaves it in key_codes[] for MS ms, or until
+ * "release" without MS, so the host's own typematic repeat applies just as
+ * for a finger on a real keyboard. "hold KEY MS HZ" also releases and
+ * presses it again HZ times a second, for hosts that have no repeat or where
+ * it must not depend on their settings. Other keys can be typed meanwhile;
+ * the held ones stay down in every report.
+ *
+ * All held keys of all devices sit on one hierarchical timing wheel: four
+ * levels of 64 slots with 1 ms, 64 ms, 4.1 s and 4.4 min resolution, each
+ * slot a list. Adding, cancelling and firing a timer is O(1) however many
+ * keys are held; a timer further out than its level resolves waits in a
+ * coarse slot and cascades to a finer one as the wheel turns, and a bitmap
+ * of occupied slots per level finds the next expiry without a scan. The
+ * wheel has one timerfd in the epoll set, armed for that expiry or for the
+ * next cascade, and none while nothing is held. Its reports go through
+ * send_event() like typed ones, so --rate and --wait-open still apply.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1u << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN	(1ull << (WHEEL_BITS * WHEEL_LEVELS))	/* in ticks */
+#define HOLD_HZ_MAX	1000
+
+static struct {
+	struct held_key *slot[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t used[WHEEL_LEVELS];	/* bit n: slot n is not empty */
+	uint64_t now;			/* last tick that ran */
+	unsigned int n;			/* timers on the wheel */
+	int tfd;
+} g_wheel = { .tfd = -1 };
+
+static inline uint64_t wheel_tick(void)
+{
+	return now_ns() / 1000000;
+}
+
+static void wheel_add(struct held_key *h)
+{
+	uint64_t t = h->tick, delta;
+	unsigned int level = 0;
+
+	/*
+	 * A cascade brings timers down for the very tick that is about to
+	 * run; late ones run on the next tick, far ones come back round
+	 */
+	if (t < g_wheel.now)
+		t = g_wheel.now + 1;
+	delta = t - g_wheel.now;
+	if (delta >= WHEEL_SPAN)
+		t = g_wheel.now + WHEEL_SPAN - 1, delta = WHEEL_SPAN - 1;
+	while (delta >= 1ull << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	h->level = level;
+	h->slot = (t >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	h->pprev = &g_wheel.slot[level][h->slot];
+	h->next = *h->pprev;
+	if (h->next)
+		h->next->pprev = &h->next;
+	*h->pprev = h;
+	g_wheel.used[level] |= 1ull << h->slot;
+	g_wheel.n++;
+}
+
+static void wheel_del(struct held_key *h)
+{
+	if (!h->pprev)
+		return;
+	*h->pprev = h->next;
+	if (h->next)
+		h->next->pprev = h->pprev;
+	if (!g_wheel.slot[h->level][h->slot])
+		g_wheel.used[h->level] &= ~(1ull << h->slot);
+	h->pprev = NULL;
+	g_wheel.n--;
+}
+
+/* Take slot @idx of @level off the wheel, returns its timers */
+static struct held_key *wheel_take(unsigned int level, unsigned int idx)
+{
+	struct held_key *list = g_wheel.slot[level][idx];
+
+	for (struct held_key *h = list; h; h = h->next) {
+		h->pprev = NULL;
+		g_wheel.n--;
+	}
+	g_wheel.slot[level][idx] = NULL;
+	g_wheel.used[level] &= ~(1ull << idx);
+	return list;
+}
+
+/* Move the timers due within the level below down to it */
+static void wheel_cascade(unsigned int level)
+{
+	unsigned int idx = (g_wheel.now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	struct held_key *h = wheel_take(level, idx), *next;
+
+	for (; h; h = next) {
+		next = h->next;
+		wheel_add(h);
+	}
+	if (!idx && level + 1 < WHEEL_LEVELS)
+		wheel_cascade(level + 1);
+}
+
+static int wheel_arm(void)
+{
+	struct itimerspec its = { 0 };
+	uint64_t next = UINT64_MAX, used = g_wheel.used[0];
+	unsigned int from = (g_wheel.now + 1) & (WHEEL_SIZE - 1);
+
+	if (g_wheel.used[1] || g_wheel.used[2] || g_wheel.used[3])
+		next = (g_wheel.now | (WHEEL_SIZE - 1)) + 1;
+	if (used) {
+		/* Level 0 slots in the order the wheel reaches them */
+		used = from ? used >> from | used << (WHEEL_SIZE - from) : used;
+		if (g_wheel.now + 1 + __builtin_ctzll(used) < next)
+			next = g_wheel.now + 1 + __builtin_ctzll(used);
+	}
+	if (next != UINT64_MAX) {
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = next % 1000 * 1000000;
+	}
+	if (timerfd_settime(g_wheel.tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		log_error("Cannot arm the hold timer: %m\n");
+		return -errno;
+	}
+	return 0;
+}
+
+static int wheel_init(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EP_TAG(0, SRC_WHEEL) };
+
+	if (g_wheel.tfd >= 0)
+		return 0;
+	g_wheel.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g_wheel.tfd < 0) {
+		log_error("Cannot create hold timer: %m\n");
+		return -errno;
+	}
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_wheel.tfd, &ev) < 0) {
+		log_error("Cannot poll hold timer: %m\n");
+		close(g_wheel.tfd);
+		g_wheel.tfd = -1;
+		return -errno;
+	}
+	return 0;
+}
+
+static void held_mods_update(struct uhid_dev *dev)
+{
+	dev->held_mods = 0;
+	for (int i = 0; i < 256; i++) {
+		if (dev->holds[i])
+			dev->held_mods |= dev->holds[i]->mods;
+	}
+}
+
+/* Let go of a held key and forget it */
+static void hold_release(struct held_key *h)
+{
+	struct uhid_dev *dev = h->dev;
+
+	wheel_del(h);
+	dev->holds[h->usage] = NULL;
+	held_mods_update(dev);
+	chord_end(dev, 0);
+	remove_key(dev, h->usage);
+	dev->modifier_keys &= ~h->mods | dev->held_mods;
+	send_event(dev, 0);
+	free(h);
+}
+
+static void hold_release_all(struct uhid_dev *dev)
+{
+	for (int i = 0; i < 256; i++) {
+		if (dev->holds[i])
+			hold_release(dev->holds[i]);
+	}
+}
+
+/* When @h runs next: its next repeat or its release, whichever comes first */
+static void hold_schedule(struct held_key *h, uint64_t now)
+{
+	if (!h->period && !h->release)
+		return;
+	h->tick = h->period ? now + h->period : h->release;
+	if (h->release && h->tick > h->release)
+		h->tick = h->release;
+	wheel_add(h);
+}
+
+/*
+ * Hold @usage with @mods down on @dev for @ms ms (0: until released),
+ * repeating it every @period ms (0: leave that to the host). Holding a key
+ * that is held already only changes its timing.
+ */
+static int hold_key(struct uhid_dev *dev, unsigned char usage, unsigned char mods,
+		    unsigned long ms, unsigned int period)
+{
+	struct held_key *h = dev->holds[usage];
+	uint64_t now = wheel_tick();
+	int ret;
+
+	ret = wheel_init();
+	if (ret)
+		return ret;
+	if (!g_wheel.n)
+		g_wheel.now = now;
+
+	if (h) {
+		wheel_del(h);
+	} else {
+		h = calloc(1, sizeof(*h));
+		if (!h)
+			return -ENOMEM;
+		h->dev = dev;
+		h->usage = usage;
+		h->mods = mods;
+		dev->holds[usage] = h;
+		dev->held_mods |= mods;
+
+		chord_end(dev, 0);
+		dev->modifier_keys |= mods;
+		add_key(dev, usage);
+		send_event(dev, 0);
+	}
+	h->period = period;
+	h->release = ms ? now + ms : 0;
+	hold_schedule(h, now);
+	return wheel_arm();
+}
+
+/* A held key is due: repeat it, or release it for good */
+static void hold_fire(struct held_key *h)
+{
+	struct uhid_dev *dev = h->dev;
+
+	if (h->tick > g_wheel.now) {
+		/* Was beyond WHEEL_SPAN, another round */
+		wheel_add(h);
+		return;
+	}
+	if (h->release && h->release <= g_wheel.now) {
+		hold_release(h);
+		return;
+	}
+	remove_key(dev, h->usage);
+	send_event(dev, 0);
+	add_key(dev, h->usage);
+	send_event(dev, 0);
+	hold_schedule(h, g_wheel.now);
+}
+
+/* SRC_WHEEL: run every tick up to now */
+static int wheel_run(void)
+{
+	uint64_t target = wheel_tick(), expirations;
+	struct held_key *h, *next;
+	int ret;
+
+	if (read(g_wheel.tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	while (g_wheel.n && g_wheel.now < target) {
+		g_wheel.now++;
+		if (!(g_wheel.now & (WHEEL_SIZE - 1)))
+			wheel_cascade(1);
+		h = wheel_take(0, g_wheel.now & (WHEEL_SIZE - 1));
+		for (; h; h = next) {
+			next = h->next;
+			hold_fire(h);
+		}
+	}
+	if (!g_wheel.n)
+		g_wheel.now = target;
+
+	for (int i = 0; i < n_devs; i++) {
+		ret = keys_flush(devs[i]);
+		if (ret)
+			return ret;
+	}
+	return wheel_arm();
+}
+
+static struct macro *macro_find(const char *name)
+{
+	for (int i = 0; i < n_macros; i++) {
+		if (!strcmp(macros[i].name, name))
+			return &macros[i];
+	}
+	return NULL;
+}
+
+/* Queue the precompiled reports of @m behind whatever @dev has pending */
+static int macro_play(struct uhid_dev *dev, const struct macro *m)
+{
+	int ret, err;
+
+	log_debug("Playing macro %s (%zu reports)\n", m->name, m->len);
+	ret = chord_end(dev, 0);
+	err = pointer_sync(dev);
+	ret = ret ? : err;
+	if (g_pacing && !dev->capture && sched_room(dev) < m->len) {
+		metric_add(metrics.sched_dropped, m->len);
+		log_warn("Pacing queue full, dropping macro %s\n", m->name);
+		return -ENOBUFS;
+	}
+	err = 0;
+	for (size_t i = 0; i < m->len && !err; i++)
+		err = sched_submit(dev, &m->seq[i].rep, m->seq[i].gap_ns);
+	return ret ? : err;
+}
+
+/*
+ * Play the macro bound to an escape sequence key, if there is one: 1 if
+ * it played, 0 if none is bound, or the error of playing it
+ */
+static int macro_trigger(struct uhid_dev *dev, unsigned char usage, unsigned char mods)
+{
+	for (int i = 0; i < n_macros; i++) {
+		if (macros[i].trig_usage == usage && macros[i].trig_mods == mods)
+			return macro_play(dev, &macros[i]) ? : 1;
+	}
+	return 0;
+}
+#endif /* UHID_KBD_LIB */
+
+/* Latin letters of ASCII and Latin-1, which Caps Lock shifts */
+static bool caps_letter(uint32_t c)
+{
+	if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+		return true;
+	return c >= 0xc0 && c <= 0xfe && c != 0xd7 && c != 0xf7 && c != 0xdf;
+}
+
+/* With Caps Lock on the host shifts letters itself, and Shift undoes it */
+static unsigned char caps_mods(const struct uhid_dev *dev, uint32_t c, unsigned char mods)
+{
+	if ((dev->leds & (1 << LED_CAPSL)) && caps_letter(c))
+		return mods ^ HID_MOD_LSHIFT;
+	return mods;
+}
+
+/* Translate one plain character, a code point */
+static int type_char(struct uhid_dev *dev, uint32_t c)
+{
+	const struct ascii_key *key = c < ARRAY_SIZE(ascii_keys) ? &ascii_keys[c] : NULL;
+	const struct layout_key *lk;
+	int ret = 0, err;
+
+	if (g_layout.bmp) {
+		lk = layout_lookup(c);
+		if (lk) {
+			log_debug("Processing character: U+%04X -> HID code: 0x%02x, modifiers 0x%02x\n",
+				  c, lk->usage, lk->mods);
+			if (lk->dead_usage)
+				ret = tap_key(dev, lk->dead_usage, lk->dead_mods);
+			err = tap_key(dev, lk->usage, caps_mods(dev, c, lk->mods));
+			return ret ? : err;
+		}
+		/* ascii_keys[] only knows where the US layout puts printable characters */
+		if (c > ' ' && c != 0x7f)
+			key = NULL;
+	}
+	if (key && key->consumer) {
+		log_debug("Processing character: %c -> %s\n", c, key->name);
+		return tap_consumer(dev, key->consumer);
+	}
+	if (!key || key->usage == 0) {
+		metric_add(metrics.unknown_chars, 1);
+		if (c < 0x80)
+			log_warn("Unknown character: %c (0x%02x)\n", c, c);
+		else
+			log_warn("Unknown character: U+%04X\n", c);
+		return 0;
+	}
+	log_debug("Processing character: %c (0x%02x) -> %s (HID code: 0x%02x)\n",
+		  c, c, key->name, key->usage);
+	return tap_key(dev, key->usage, caps_mods(dev, c, key->mods));
+}
+
+/* Act on the final byte of a CSI or SS3 sequence */
+static int esc_finish(struct uhid_dev *dev, struct esc_parser *esc, unsigned char final)
+{
+	const struct esc_key *key = NULL;
+	unsigned char mods = 0;
+
+	if (esc->state == ESC_CSI && final == '~') {
+		if (esc->param[0] < sizeof(esc_tilde_keys) / sizeof(esc_tilde_keys[0]))
+			key = &esc_tilde_keys[esc->param[0]];
+	} else if (esc->state == ESC_CSI && final == 'Z') {
+		/* Back-tab */
+		log_debug("Processing escape sequence -> SHIFT_TAB\n");
+		return tap_key(dev, HID_TAB, HID_MOD_LSHIFT);
+	} else if (final < 128) {
+		key = &esc_final_keys[final];
+	}
+	if (esc->nparam && esc->param[1] >= 1 && esc->param[1] <= 16)
+		mods = esc_mods[esc->param[1] - 1];
+
+	if (key && key->consumer) {
+		log_debug("Processing escape sequence -> %s\n", key->name);
+		return tap_consumer(dev, key->consumer);
+	} else if (key && key->usage) {
+#ifndef UHID_KBD_LIB
+		int ret = n_macros ? macro_trigger(dev, key->usage, mods) : 0;
+		if (ret)
+			return ret < 0 ? ret : 0;
+#endif
+		log_debug("Processing escape sequence -> %s (HID code: 0x%02x, modifiers 0x%02x)\n",
+			  key->name, key->usage, mods);
+		return tap_key(dev, key->usage, mods);
+	}
+	metric_add(metrics.esc_dropped, 1);
+	log_debug("Ignoring escape sequence ending in %c\n", final);
+	return 0;
+}
+
+/* Resolve a sequence that timed out or was cut short by the end of input */
+static int esc_expire(struct uhid_dev *dev, struct esc_parser *esc)
+{
+	int ret = 0;
+
+	if (esc->state == ESC_ESC) {
+		log_debug("Processing character: ESC -> ESC (HID code: 0x%02x)\n", HID_KEY_ESC);
+		ret = tap_key(dev, HID_KEY_ESC, 0);
+	} else if (esc->state != ESC_GROUND) {
+		metric_add(metrics.esc_dropped, 1);
+		log_debug("Dropping incomplete escape sequence\n");
+	} else if (esc->utf8_need) {
+		esc->utf8_need = 0;
+		ret = type_char(dev, UTF8_INVALID);
+	}
+	esc->state = ESC_GROUND;
+	esc->deadline = 0;
+	return ret;
+}
+
+/*
+ * Bulk text
+ * Pasted text is mostly plain printable ASCII. plain_run() finds how far
+ * such a run goes, 16 or 32 bytes per step with SSE2, AVX2 or NEON, and
+ * type_run() translates all of it at once: one pass through ascii_keys[]
+ * for the usages and modifiers, then, unless something has to see every
+ * report (pacing, macro capture, chords, held keys), a press and a
+ * release report per character go straight into batch[]. Debug output
+ * then has one line per run instead of one per report.
+ * A release never repeats its press and a press never repeats the
+ * release before it, so duplicate suppression has nothing to do there.
+ * ESC, '{', '}', control characters and anything that is not ASCII end a
+ * run and go through the state machine in translate().
+ */
+#define RUN_MAX 256
+
+static inline bool plain_byte(unsigned char c)
+{
+	return c >= 0x20 && c < 0x7f && c != '{' && c != '}';
+}
+
+/* Length of the run of plain bytes at @s, at most @len */
+static size_t plain_run(const unsigned char *s, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i space = _mm256_set1_epi8(0x20), del = _mm256_set1_epi8(0x7f);
+	const __m256i lbrace = _mm256_set1_epi8('{'), rbrace = _mm256_set1_epi8('}');
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		/* Signed, so bytes from 0x80 up are below space as well */
+		__m256i stop = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, lbrace), _mm256_cmpeq_epi8(v, rbrace)));
+		unsigned int mask = _mm256_movemask_epi8(stop);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	const __m128i lbrace = _mm_set1_epi8('{'), rbrace = _mm_set1_epi8('}');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		/* Signed, so bytes from 0x80 up are below space as well */
+		__m128i stop = _mm_or_si128(
+			_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, lbrace), _mm_cmpeq_epi8(v, rbrace)));
+		unsigned int mask = _mm_movemask_epi8(stop);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(s + i);
+		uint8x16_t stop = vorrq_u8(
+			vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgtq_u8(v, vdupq_n_u8(0x7e))),
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8('{')), vceqq_u8(v, vdupq_n_u8('}'))));
+
+		/* The scalar loop below finds where in these 16 bytes */
+		if (vmaxvq_u8(stop))
+			break;
+	}
+#endif
+	while (i < len && plain_byte(s[i]))
+		i++;
+	return i;
+}
+
+/* Whether the reports of a run may go straight into batch[] */
+static bool run_direct(const struct uhid_dev *dev)
+{
+	return !g_pacing && !dev->capture && !g_coalesce && !dev->nkro && g_batch &&
+	       !dev->num_keys_pressed && !dev->modifier_keys;
+}
+
+/* Type the @n <= RUN_MAX plain characters at @s */
+static int type_run(struct uhid_dev *dev, const unsigned char *s, size_t n)
+{
+	unsigned char usage[RUN_MAX], mods[RUN_MAX];
+	unsigned char caps = dev->leds & (1 << LED_CAPSL) ? HID_MOD_LSHIFT : 0;
+	struct uhid_report idle, *rep;
+	size_t len;
+	int ret = 0, err;
+
+	for (size_t i = 0; i < n; i++) {
+		usage[i] = ascii_keys[s[i]].usage;
+		mods[i] = ascii_keys[s[i]].mods ^ ((unsigned char)((s[i] | 0x20) - 'a') < 26 ? caps : 0);
+	}
+	/* Report ID 1 with nothing pressed; a press sets two bytes of it */
+	idle = dev->kbd_report;
+	memset(&idle.data[1], 0, idle.size - 1);
+	len = UHID_REPORT_LEN(&idle);
+	if (!run_direct(dev) || (g_dedup && memcmp(dev->last_sent[1], idle.data, idle.size))) {
+		for (size_t i = 0; i < n; i++) {
+			err = tap_key(dev, usage[i], mods[i]);
+			ret = ret ? : err;
+		}
+		return ret;
+	}
+
+	log_debug("Typing %zu characters: %.*s\n", n, (int)n, (const char *)s);
+	for (size_t i = 0; i < 2 * n; i++) {
+		ret = uhid_reserve(dev);
+		if (ret) {
+			/* A press may be out without its release, send the next idle one */
+			report_forget(dev);
+			return ret;
+		}
+		rep = &dev->batch[dev->batch_len];
+		memcpy(rep, &idle, len);
+		if (!(i & 1)) {
+			rep->data[1] = mods[i / 2];
+			rep->data[3] = usage[i / 2];
+		}
+		dev->batch_iov[dev->batch_len].iov_base = rep;
+		dev->batch_iov[dev->batch_len++].iov_len = len;
+	}
+	memcpy(dev->last_sent[1], idle.data, idle.size);
+	return 0;
+}
+
+/*
+ * Translate @len bytes of UTF-8 input into reports. Bytes that are not
+ * valid UTF-8 count as U+FFFD. Escape sequences and characters may
+ * continue in the next call; the caller flushes the reports. All of
+ * @buf is parsed even if a report fails; returns the first error.
+ */
+static int translate(struct uhid_dev *dev, struct esc_parser *esc, const char *buf, size_t len)
+{
+	int ret = 0, err = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		switch (esc->state) {
+		case ESC_GROUND:
+			/* --layout puts ASCII elsewhere, type_char() knows where */
+			if (plain_byte(c) && !esc->utf8_need && !g_layout.bmp) {
+				size_t run = plain_run((const unsigned char *)buf + i,
+						       len - i < RUN_MAX ? len - i : RUN_MAX);
+
+				err = type_run(dev, (const unsigned char *)buf + i, run);
+				i += run - 1;
+				break;
+			}
+			if (esc->utf8_need) {
+				if ((c & 0xc0) == 0x80) {
+					esc->cp = esc->cp << 6 | (c & 0x3f);
+					if (--esc->utf8_need)
+						break;
+					if (esc->cp < utf8_min[esc->utf8_len] || esc->cp > 0x10ffff ||
+					    (esc->cp >= 0xd800 && esc->cp < 0xe000))
+						esc->cp = UTF8_INVALID;
+					err = type_char(dev, esc->cp);
+					break;
+				}
+				/* Cut short; handle this byte afresh */
+				esc->utf8_need = 0;
+				err = type_char(dev, UTF8_INVALID);
+				ret = ret ? : err;
+			}
+			if (c == 27) {
+				esc->state = ESC_ESC;
+				esc->nparam = 0;
+				esc->param[0] = esc->param[1] = 0;
+			} else if (c < 0x80) {
+				err = type_char(dev, c);
+			} else if (c >= 0xc2 && c <= 0xf4) {
+				esc->utf8_need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+				esc->utf8_len = esc->utf8_need + 1;
+				esc->cp = c & (0x3f >> esc->utf8_need);
+			} else {
+				err = type_char(dev, UTF8_INVALID);
+			}
+			break;
+		case ESC_ESC:
+			if (c == '[') {
+				esc->state = ESC_CSI;
+			} else if (c == 'O') {
+				esc->state = ESC_SS3;
+			} else {
+				/* The ESC stood alone; handle this byte afresh */
+				err = esc_expire(dev, esc);
+				i--;
+			}
+			break;
+		case ESC_CSI:
+			if (c >= '0' && c <= '9') {
+				unsigned short *p = &esc->param[esc->nparam];
+
+				if (*p < 1000)
+					*p = *p * 10 + (c - '0');
+			} else if (c == ';') {
+				if (esc->nparam < 1)
+					esc->nparam++;
+			} else if (c >= 0x40 && c <= 0x7e) {
+				err = esc_finish(dev, esc, c);
+				esc->state = ESC_GROUND;
+			} else if (c < 0x20 || c == 0x7f) {
+				/* Not a sequence after all */
+				err = esc_expire(dev, esc);
+				i--;
+			}
+			/* Intermediate and private bytes are ignored */
+			break;
+		case ESC_SS3:
+			err = esc_finish(dev, esc, c);
+			esc->state = ESC_GROUND;
+			break;
+		}
+		ret = ret ? : err;
+		err = 0;
+	}
+	return ret;
+}
+
+/* The program's input decoders, which the fuzzer drives too */
+#if !defined(UHID_KBD_LIB) || defined(UHID_FUZZ)
+static uint64_t g_esc_timeout_ns = 50000000;	/* --esc-timeout */
+
+/* Translate @len bytes of input into reports and flush them */
+static int process_input(struct uhid_dev *dev, struct esc_parser *esc, const char *buf, ssize_t len)
+{
+	int ret = translate(dev, esc, buf, len), err;
+
+	/* Give a pending ESC a moment for the rest of its sequence */
+	if (esc->state != ESC_GROUND) {
+		if (g_esc_timeout_ns) {
+			esc->deadline = now_ns() + g_esc_timeout_ns;
+		} else {
+			err = esc_expire(dev, esc);
+			ret = ret ? : err;
+		}
+	}
+
+	err = keys_flush(dev);
+	return ret ? : err;
+}
+
+#ifndef UHID_KBD_LIB
+/* Expire @esc if its deadline passed; returns ms until it does, or -1 */
+static int esc_poll_timeout(struct uhid_dev *dev, struct esc_parser *esc)
+{
+	uint64_t now;
+
+	if (esc->state == ESC_GROUND || !esc->deadline)
+		return -1;
+	now = now_ns();
+	if (now < esc->deadline)
+		return (esc->deadline - now + 999999) / 1000000;
+	esc_expire(dev, esc);
+	keys_flush(dev);
+	return -1;
+}
+
+/* Send the motion of @dev once its frame is over; returns ms until then, or -1 */
+static int pointer_poll_timeout(struct uhid_dev *dev)
+{
+	uint64_t now;
+
+	if (!dev->frame_ns)
+		return -1;
+	now = now_ns();
+	if (now < dev->frame_ns)
+		return (dev->frame_ns - now + 999999) / 1000000;
+	keys_flush(dev);
+	return -1;
+}
+#endif
+
+/*
+ * Binary records
+ * With --binary, or on a listener opened with ",binary", input is a stream
+ * of fixed-size struct bin_record instead of text. A record is copied
+ * straight into the report template of its report ID and submitted, with
+ * no translation, so any modifier combination and any usage can be sent.
+ * A non-zero hold_ms (little endian) queues the matching all-up report that
+ * long after the press through the pacing queue, which binary input always
+ * enables; with hold_ms 0 the report stays in effect until the next record
+ * for that report ID, which lets a controller hold keys down itself.
+ * Report ID 0 selects the target device by index in usages[0].
+ */
+#ifndef UHID_KBD_LIB
+static bool g_binary = false;	/* --binary */
+static bool g_binary_used = false;	/* any binary source, enables pacing */
+#endif
+
+/* Submit one record; like translate() it drops what it does not know */
+static int bin_record(struct bin_stream *bs, const struct bin_record *r)
+{
+	uint64_t hold_ns = le16toh(r->hold_ms) * 1000000ull;
+	struct uhid_dev *dev = bs->dev;
+	struct uhid_report *rep;
+	int ret, err;
+
+	switch (r->report_id) {
+	case 0x00:
+		if (r->usages[0] >= n_devs) {
+			log_warn("Binary record selects unknown device %u\n", r->usages[0]);
+			return 0;
+		}
+		bs->dev = devs[r->usages[0]];
+		return uhid_flush(dev);
+	case 0x01:
+		rep = &dev->kbd_report;
+		rep->data[1] = r->mods;
+		memcpy(&rep->data[3], r->usages, sizeof(r->usages));
+		break;
+	case 0x02:
+		rep = &dev->consumer_report;
+		rep->data[1] = r->usages[0];
+		rep->data[2] = r->usages[1];
+		break;
+	default:
+		log_warn("Binary record with unknown report ID %u\n", r->report_id);
+		return 0;
+	}
+	ret = sched_submit(dev, rep, 0);
+
+	if (hold_ns) {
+		memset(&rep->data[1], 0, rep->size - 1);
+		err = sched_submit(dev, rep, hold_ns);
+		ret = ret ? : err;
+	}
+	return ret;
+}
+
+/*
+ * Submit the records in @len bytes at @buf and flush them. All of them
+ * are submitted even if a report fails; returns the first error.
+ */
+static int bin_input(struct bin_stream *bs, const char *buf, size_t len)
+{
+	const size_t rec = sizeof(struct bin_record);
+	struct bin_record r;
+	int ret = 0, err;
+
+	/* Complete a record that was split over two reads */
+	if (bs->len) {
+		size_t n = rec - bs->len < len ? rec - bs->len : len;
+
+		memcpy(bs->part + bs->len, buf, n);
+		bs->len += n;
+		buf += n;
+		len -= n;
+		if (bs->len < rec)
+			return 0;
+		memcpy(&r, bs->part, rec);
+		ret = bin_record(bs, &r);
+		bs->len = 0;
+	}
+	for (; len >= rec; buf += rec, len -= rec) {
+		memcpy(&r, buf, rec);
+		err = bin_record(bs, &r);
+		ret = ret ? : err;
+	}
+	memcpy(bs->part, buf, len);
+	bs->len = len;
+
+	err = uhid_flush(bs->dev);
+	return ret ? : err;
+}
+
+/* Feed @len bytes of device input to the text or the binary decoder */
+static int input_process(struct uhid_dev *dev, const char *buf, size_t len)
+{
+	if (dev->in_binary)
+		return bin_input(&dev->bin, buf, len);
+	return process_input(dev, &dev->esc, buf, len);
+}
+#endif
+
+#ifndef UHID_KBD_LIB
+/*
+ * Input streams
+ * Each device reads at most one input: --input or stdin for the first
+ * device, and whatever its --device spec names for the others. Interactive
+ * use reads the tty as the keys come. Bulk text (a file, or a pipe) is read
+ * with a large buffer so that one epoll wakeup covers up to INPUT_BUF_SIZE
+ * bytes. A regular file is mapped and fed to process_input() in chunks of
+ * that size without any read() at all, one chunk per main loop pass so that
+ * other devices and uhid events are served in between; so is anything else
+ * epoll cannot watch, such as /dev/null, through read().
+ *
+ * Bulk input only starts flowing once the kernel has started the device, as
+ * reports sent before the driver binds would be lost.
+ */
+#define INPUT_BUF_SIZE (64 * 1024)
+#define START_TIMEOUT_MS 2000
+
+
+static int input_open(struct uhid_dev *dev)
+{
+	struct stat st;
+
+	if (!strcmp(dev->in_path, "-")) {
+		dev->in_fd = STDIN_FILENO;
+	} else {
+		dev->in_fd = open(dev->in_path, O_RDONLY | O_CLOEXEC);
+		if (dev->in_fd < 0) {
+			log_error("Cannot open input %s: %m\n", dev->in_path);
+			return -errno;
+		}
+	}
+	dev->in_bulk = !isatty(dev->in_fd);
+	dev->esc = (struct esc_parser){ 0 };
+	dev->in_binary = g_binary;
+	dev->bin.dev = dev;
+
+	if (fstat(dev->in_fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+	dev->in_eager = true;
+	if (!st.st_size) {
+		dev->in_done = true;
+		return 0;
+	}
+	dev->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, dev->in_fd, 0);
+	if (dev->map == MAP_FAILED) {
+		dev->map = NULL;
+		log_error("Cannot map input %s: %m\n", dev->in_path);
+		return -errno;
+	}
+	madvise((void *)dev->map, st.st_size, MADV_SEQUENTIAL);
+	dev->map_size = st.st_size;
+	return 0;
+}
+
+/* True when @dev may take another chunk of input now */
+static bool input_ready(const struct uhid_dev *dev)
+{
+	if (dev->in_fd < 0 || dev->in_done)
+		return false;
+	if (dev->in_bulk && !dev->started)
+		return false;
+	/* Stop reading input while the pacing queue is backed up */
+	return !g_pacing || sched_room(dev) >= SCHED_MAX / 2;
+}
+
+/* Add or remove the input of @dev from the epoll set as input_ready() says */
+static int input_update(struct uhid_dev *dev, int idx)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EP_TAG(idx, SRC_INPUT) };
+	bool ready = input_ready(dev);
+
+#ifdef UHID_IO_URING
+	if (dev->ring)
+		return 0;	/* read through the ring, see uring_poll() */
+#endif
+	if (dev->in_eager || ready == dev->in_polled)
+		return 0;
+	if (epoll_ctl(g_epfd, ready ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, dev->in_fd, &ev)) {
+		if (errno == EPERM) {
+			dev->in_eager = true;
+			return 0;
+		}
+		log_error("Cannot watch input of %s: %m\n", dev->name);
+		return -errno;
+	}
+	dev->in_polled = ready;
+	return 0;
+}
+
+/* The input of @dev ended: resolve a pending ESC and stop watching it */
+static void input_finish(struct uhid_dev *dev)
+{
+	dev->in_done = true;
+	if (dev->in_polled) {
+		epoll_ctl(g_epfd, EPOLL_CTL_DEL, dev->in_fd, NULL);
+		dev->in_polled = false;
+	}
+	if (dev->bin.len)
+		log_warn("Dropping %zu trailing bytes of input for %s\n", dev->bin.len, dev->name);
+	esc_expire(dev, &dev->esc);
+	keys_flush(dev);
+}
+
+/* How much of the input of @dev to read at once */
+static size_t input_chunk(const struct uhid_dev *dev)
+{
+	size_t len = dev->in_bulk ? INPUT_BUF_SIZE : 128;
+
+	/* Leave room in the pacing queue for the reports of a whole read */
+	if (g_pacing && len > sched_room(dev) / 4)
+		len = sched_room(dev) / 4;
+	return len;
+}
+
+/* Handle the result @ret of reading @buf from the input of @dev */
+static int input_consume(struct uhid_dev *dev, const char *buf, ssize_t ret)
+{
+	if (ret == 0) {
+		if (dev->in_bulk) {
+			log_info("End of input for %s\n", dev->name);
+			return 1;
+		}
+		log_error("Read HUP on stdin\n");
+		return -EFAULT;
+	} else if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		log_error("Cannot read input of %s: %m\n", dev->name);
+		return -errno;
+	}
+
+	hist_add(&metrics.input_bytes, ret);
+	return input_process(dev, buf, ret);
+}
+
+static int keyboard(struct uhid_dev *dev)
+{
+	static char buf[INPUT_BUF_SIZE];
+
+	return input_consume(dev, buf, read(dev->in_fd, buf, input_chunk(dev)));
+}
+
+/* Feed the next chunk of an input epoll cannot watch; 1 at its end */
+static int input_feed(struct uhid_dev *dev)
+{
+	size_t n;
+	int ret;
+
+	if (!dev->map)
+		return keyboard(dev);
+
+	n = dev->map_size - dev->map_off;
+	if (n > INPUT_BUF_SIZE)
+		n = INPUT_BUF_SIZE;
+	if (g_pacing && n > sched_room(dev) / 4)
+		n = sched_room(dev) / 4;
+	hist_add(&metrics.input_bytes, n);
+	ret = input_process(dev, dev->map + dev->map_off, n);
+	dev->map_off += n;
+	if (!ret && dev->map_off == dev->map_size) {
+		log_info("End of input for %s (%zu bytes)\n", dev->name, dev->map_size);
+		return 1;
+	}
+	return ret;
+}
+
+/*
+ * Trace replay (--replay)
+ * The reports of a --record trace go straight into batch[] of the device
+ * they came from, past translation, dedup and pacing, once every device is
+ * started. A timerfd in the epoll set fires when the next one is due: at
+ * its recorded time divided by --replay-speed, or right away with a speed
+ * of 0, which replays as fast as the write path takes them. Either way at
+ * most REPLAY_CHUNK reports go out per wakeup, so uhid events and commands
+ * are still handled during a replay.
+ */
+#define REPLAY_CHUNK (16 * UHID_BATCH_MAX)
+
+static struct {
+	const unsigned char *map;
+	size_t size, off;
+	const char *path;
+	double speed;
+	uint64_t next_ns;	/* trace time of the record at off */
+	size_t next_off;	/* ...and where it continues after the delta */
+	uint64_t start_ns;	/* when the replay started, 0 before */
+	uint64_t start_deadline;
+	uint64_t reports, skipped;
+	int tfd;
+} g_replay = { .speed = 1, .tfd = -1 };
+
+static bool replay_busy(void)
+{
+	return g_replay.map && g_replay.off < g_replay.size;
+}
+
+/* Decode the delta of the record at off */
+static int replay_peek(void)
+{
+	uint64_t delta = 0;
+	size_t off = g_replay.off;
+
+	for (unsigned int shift = 0; ; shift += 7) {
+		if (off == g_replay.size || shift > 63)
+			return -EINVAL;
+		delta |= (uint64_t)(g_replay.map[off] & 0x7f) << shift;
+		if (!(g_replay.map[off++] & 0x80))
+			break;
+	}
+	g_replay.next_ns += delta;
+	g_replay.next_off = off;
+	return 0;
+}
+
+static int replay_open(const char *path)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EP_TAG(0, SRC_REPLAY) };
+	size_t magic = strlen(TRACE_MAGIC);
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error("Cannot open trace %s: %m\n", path);
+		return -errno;
+	}
+	if (fstat(fd, &st) || (size_t)st.st_size < magic) {
+		log_error("Not a trace: %s\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Cannot map trace %s: %m\n", path);
+		return -errno;
+	}
+	if (memcmp(map, TRACE_MAGIC, magic)) {
+		log_error("Not a trace: %s\n", path);
+		munmap(map, st.st_size);
+		return -EINVAL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	g_replay.map = map;
+	g_replay.size = st.st_size;
+	g_replay.off = magic;
+	g_replay.path = path;
+	g_replay.start_deadline = now_ns() + START_TIMEOUT_MS * 1000000ull;
+	if (replay_busy() && replay_peek()) {
+		log_error("Truncated trace %s\n", path);
+		return -EINVAL;
+	}
+
+	g_replay.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g_replay.tfd < 0) {
+		log_error("Cannot create replay timer: %m\n");
+		return -errno;
+	}
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_replay.tfd, &ev) < 0) {
+		log_error("Cannot poll replay timer: %m\n");
+		return -errno;
+	}
+	return 0;
+}
+
+/* When the record at off is due, 0 for right away */
+static uint64_t replay_due(void)
+{
+	if (!g_replay.speed)
+		return 0;
+	return g_replay.start_ns + (uint64_t)(g_replay.next_ns / g_replay.speed);
+}
+
+static void replay_arm(uint64_t due)
+{
+	struct itimerspec its = { 0 };
+
+	if (replay_busy()) {
+		/* 0 would disarm the timer */
+		its.it_value.tv_sec = due / 1000000000ull;
+		its.it_value.tv_nsec = due % 1000000000ull ? : 1;
+	}
+	timerfd_settime(g_replay.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Start the replay once all devices are started; called every loop pass
+ * before that, returns an error if they take too long
+ */
+static int replay_start(uint64_t now)
+{
+	for (int i = 0; i < n_devs; i++) {
+		if (devs[i]->started)
+			continue;
+		if (now < g_replay.start_deadline)
+			return 0;
+		log_error("No UHID_START for %s within %d ms\n", devs[i]->name, START_TIMEOUT_MS);
+		return -ETIMEDOUT;
+	}
+	log_info("Replaying %s\n", g_replay.path);
+	g_replay.start_ns = now;
+	replay_arm(replay_due());
+	return 0;
+}
+
+/* SRC_REPLAY: submit and flush what is due */
+static int replay_run(void)
+{
+	uint64_t expirations, now = now_ns();
+	struct uhid_report rep = { .type = UHID_INPUT2 };
+	unsigned int n = 0;
+	size_t off;
+	int idx, ret;
+
+	if (read(g_replay.tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		log_warn("Cannot read timerfd: %m\n");
+
+	while (replay_busy() && n < REPLAY_CHUNK && replay_due() <= now) {
+		off = g_replay.next_off;
+		if (g_replay.size - off < 2 || g_replay.map[off + 1] > UHID_REPORT_MAX ||
+		    g_replay.size - off - 2 < g_replay.map[off + 1]) {
+			log_error("Truncated trace %s at byte %zu\n", g_replay.path, g_replay.off);
+			return -EINVAL;
+		}
+		idx = g_replay.map[off];
+		rep.size = g_replay.map[off + 1];
+		memcpy(rep.data, g_replay.map + off + 2, rep.size);
+		g_replay.off = off + 2 + rep.size;
+		if (replay_busy() && replay_peek()) {
+			log_error("Truncated trace %s at byte %zu\n", g_replay.path, g_replay.off);
+			return -EINVAL;
+		}
+
+		if (idx >= n_devs || !rep.size) {
+			g_replay.skipped++;
+			continue;
+		}
+		/* What the device sent last is still what dedup compares with */
+		if (rep.data[0] < REPORT_ID_COUNT)
+			memcpy(devs[idx]->last_sent[rep.data[0]], rep.data, rep.size);
+		ret = uhid_submit(devs[idx], &rep);
+		if (ret)
+			return ret;
+		g_replay.reports++;
+		n++;
+	}
+	for (int i = 0; i < n_devs; i++) {
+		ret = uhid_flush(devs[i]);
+		if (ret)
+			return ret;
+	}
+
+	if (replay_busy()) {
+		replay_arm(n == REPLAY_CHUNK ? now : replay_due());
+	} else {
+		log_info("Replayed %" PRIu64 " reports of %s in %" PRIu64 " ms\n", g_replay.reports,
+			 g_replay.path, (now - g_replay.start_ns) / 1000000);
+		if (g_replay.skipped)
+			log_warn("Skipped %" PRIu64 " reports for devices that do not exist\n",
+				 g_replay.skipped);
+		replay_arm(0);
+	}
+	return 0;
+}
+
+static void replay_close(void)
+{
+	if (g_replay.tfd >= 0)
+		close(g_replay.tfd);
+	if (g_replay.map)
+		munmap((void *)g_replay.map, g_replay.size);
+}
+
+/*
+ * Control socket
+ * --listen opens a unix, TCP or UDP socket that takes keystroke commands
+ * from other machines or processes without a shell in between. Commands
+ * are text lines and any number of them may arrive in one packet; they are
+ * run in order straight through tap_key()/translate() and every device the
+ * packet touched is flushed once at its end, pointer motion once its frame
+ * is over. Nothing is sent back unless a command fails or asks for it, so
+ * a client never waits for a round trip:
+ *
+ *   type TEXT        type TEXT; \n, \t, \e, \\ and \xHH are unescaped
+ *   key [MOD+]KEY    tap KEY (a character, a name such as enter or f5, or
+ *                    a 0xUSAGE) with ctrl, shift, alt, altgr and/or gui
+ *                    held
+ *   consumer NAME    tap a consumer control (volup, mute, next, back, ...,
+ *                    see CONSUMER_USAGES) or a 0xUSAGE
+ *   macro NAME       play a macro from --macros
+ *   move DX DY [WHEEL [PAN]]
+ *                    move the mouse of a --pointer device
+ *   moveto X Y       put its absolute pointer at X, Y out of 0-32767
+ *   click [BUTTON]   click left (default), right, middle, back or forward
+ *   button BUTTON down|up
+ *                    press or release a mouse button
+ *   resend           send the current state again, see "Duplicate reports"
+ *   hold [MOD+]KEY [MS [HZ]]
+ *                    press KEY and keep it down for MS ms, or until the
+ *                    release; with HZ, repeat it that often meanwhile
+ *                    instead of leaving that to the host, see "Held keys"
+ *   release [[MOD+]KEY]
+ *                    let go of a held KEY, or of all held keys
+ *   dev NAME|INDEX   send the following commands to that device, or
+ *                    refuse them if there is no such device
+ *   leds [watch|unwatch]
+ *                    reply "LEDS num caps ..." ("none", or "unknown" until
+ *                    the host set them) for the device; after watch, a
+ *                    stream client gets such a line whenever they change
+ *
+ * The device selection lasts for a stream connection and for one datagram.
+ * A listener opened as "ADDR,binary" takes struct bin_record instead.
+ */
+#define CTL_MAX_LISTEN	8
+#define CTL_MAX_CLIENTS	64
+#define CTL_LINE_MAX	1024
+
+struct ctl_listener {
+	int fd;
+	bool dgram;
+	bool binary;		/* struct bin_record framing */
+	const char *spec;
+	char path[108];		/* unix socket to remove at exit */
+};
+
+struct ctl_client {
+	int fd;
+	bool binary;		/* struct bin_record framing instead of lines */
+	struct bin_stream bin;
+	struct uhid_dev *dev;	/* target of the commands */
+	struct uhid_dev *leds_watch;	/* gets LEDS lines when its LEDs change */
+	const struct sockaddr *peer;	/* datagram source, for replies */
+	socklen_t peer_len;
+	size_t len;
+	char buf[CTL_LINE_MAX];	/* partial line carried over to the next read */
+	bool discard;		/* skipping the rest of a line that was too long */
+};
+
+static struct ctl_listener listeners[CTL_MAX_LISTEN];
+static int n_listeners;
+static struct ctl_client *clients[CTL_MAX_CLIENTS];
+
+static const struct {
+	const char *name;
+	unsigned char usage;
+} ctl_key_names[] = {
+	{ "enter", HID_KEY_ENTER },	{ "return", HID_KEY_ENTER },
+	{ "esc", HID_KEY_ESC },		{ "escape", HID_KEY_ESC },
+	{ "tab", HID_TAB },		{ "space", HID_KEY_SPACE },
+	{ "backspace", HID_KEY_BACKSPACE },
+	{ "up", HID_KEY_UP },		{ "down", HID_KEY_DOWN },
+	{ "left", HID_KEY_LEFT },	{ "right", HID_KEY_RIGHT },
+	{ "home", HID_KEY_HOME },	{ "end", HID_KEY_END },
+	{ "pageup", HID_KEY_PAGEUP },	{ "pagedown", HID_KEY_PAGEDOWN },
+	{ "insert", HID_KEY_INSERT },	{ "delete", HID_KEY_DELETE },
+};
+
+static const struct {
+	const char *name;
+	unsigned char mods;
+} ctl_mod_names[] = {
+	{ "ctrl", HID_MOD_LCTRL },	{ "shift", HID_MOD_LSHIFT },
+	{ "alt", HID_MOD_LALT },	{ "gui", HID_MOD_LGUI },
+	{ "meta", HID_MOD_LGUI },	{ "super", HID_MOD_LGUI },
+	{ "altgr", HID_MOD_RALT },	{ "ralt", HID_MOD_RALT },
+};
+
+#define CONSUMER_NAME(id, name, usage) { name, CC_##id },
+static const struct {
+	const char *name;
+	unsigned short usage;
+} ctl_consumer_names[] = {
+	CONSUMER_USAGES(CONSUMER_NAME)
+};
+
+static void ctl_reply(struct ctl_client *c, const char *fmt, ...)
+{
+	char msg[CTL_LINE_MAX + 64];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(msg))
+		len = sizeof(msg) - 1;
+	if (c->fd < 0) {
+		log_error("%s", msg + 4);	/* a macro file, no "ERR " */
+		return;
+	}
+	/* Best effort: a client that does not read its errors loses them */
+	sendto(c->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL, c->peer, c->peer_len);
+}
+
+/* Resolve [MOD+]...KEY into a usage and modifiers; 0 if unknown */
+static unsigned char ctl_parse_key(char *arg, unsigned char *mods)
+{
+	char *plus, *end;
+	unsigned long n;
+	size_t i;
+
+	*mods = 0;
+	while ((plus = strchr(arg, '+')) && plus[1]) {
+		*plus = '\0';
+		for (i = 0; i < ARRAY_SIZE(ctl_mod_names); i++) {
+			if (!strcasecmp(arg, ctl_mod_names[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(ctl_mod_names))
+			return 0;
+		*mods |= ctl_mod_names[i].mods;
+		arg = plus + 1;
+	}
+
+	if (arg[0] && !arg[1]) {
+		*mods |= ascii_keys[(unsigned char)arg[0]].mods;
+		return ascii_keys[(unsigned char)arg[0]].usage;
+	}
+	for (i = 0; i < ARRAY_SIZE(ctl_key_names); i++) {
+		if (!strcasecmp(arg, ctl_key_names[i].name))
+			return ctl_key_names[i].usage;
+	}
+	if ((arg[0] == 'f' || arg[0] == 'F') && arg[1] >= '1' && arg[1] <= '9') {
+		n = strtoul(arg + 1, &end, 10);
+		if (!*end && n >= 1 && n <= 12)
+			return HID_KEY_F1 + n - 1;
+	}
+	if (!strncmp(arg, "0x", 2)) {
+		n = strtoul(arg, &end, 16);
+		if (!*end && n > 0 && n <= 0xff)
+			return n;
+	}
+	return 0;
+}
+
+/* Undo the escapes of a type command in place, returns the new length */
+static size_t ctl_unescape(char *s)
+{
+	char *start = s, *out = s, hex[3] = { 0 };
+
+	for (; *s; s++) {
+		if (*s != '\\' || !s[1]) {
+			*out++ = *s;
+			continue;
+		}
+		switch (*++s) {
+		case 'n': *out++ = '\n'; break;
+		case 't': *out++ = '\t'; break;
+		case 'e': *out++ = 27; break;
+		case 'x':
+			if (s[1] && s[2]) {
+				memcpy(hex, s + 1, 2);
+				*out++ = strtoul(hex, NULL, 16);
+				s += 2;
+			}
+			break;
+		default: *out++ = *s; break;
+		}
+	}
+	*out = '\0';
+	return out - start;
+}
+
+/* Run one command line */
+static void ctl_command(struct ctl_client *c, char *line)
+{
+	char *arg = line + strcspn(line, " \t");
+	unsigned char usage, mods;
+	size_t i;
+	int ret, err;
+
+	/* Exactly one separator, so that type keeps leading blanks */
+	if (*arg)
+		*arg++ = '\0';
+
+	if (!*line || *line == '#')
+		return;
+	/* After a failed dev nothing may land on the previous device */
+	if (!c->dev && strcmp(line, "dev")) {
+		ctl_reply(c, "ERR no device selected\n");
+		return;
+	}
+	if (!strcmp(line, "type")) {
+		struct esc_parser esc = { 0 };
+		size_t len = ctl_unescape(arg);
+
+		/* A sequence cannot continue past the end of its line */
+		ret = translate(c->dev, &esc, arg, len);
+		err = esc_expire(c->dev, &esc);
+		ret = ret ? : err;
+		if (ret)
+			ctl_reply(c, "ERR cannot type: %s\n", strerror(-ret));
+	} else if (!strcmp(line, "key")) {
+		usage = ctl_parse_key(arg, &mods);
+		if (!usage) {
+			ctl_reply(c, "ERR unknown key %s\n", arg);
+			return;
+		}
+		ret = tap_key(c->dev, usage, mods);
+		if (ret)
+			ctl_reply(c, "ERR cannot send %s: %s\n", arg, strerror(-ret));
+	} else if (!strcmp(line, "consumer")) {
+		unsigned long usage = 0;
+		char *end;
+
+		for (i = 0; i < ARRAY_SIZE(ctl_consumer_names); i++) {
+			if (!strcasecmp(arg, ctl_consumer_names[i].name)) {
+				usage = ctl_consumer_names[i].usage;
+				break;
+			}
+		}
+		if (!usage && !strncmp(arg, "0x", 2)) {
+			usage = strtoul(arg, &end, 16);
+			if (*end || usage > CONSUMER_USAGE_MAX)
+				usage = 0;
+		}
+		if (!usage) {
+			ctl_reply(c, "ERR unknown consumer key %s\n", arg);
+			return;
+		}
+		ret = tap_consumer(c->dev, usage);
+		if (ret)
+			ctl_reply(c, "ERR cannot send %s: %s\n", arg, strerror(-ret));
+	} else if (!strcmp(line, "macro")) {
+		struct macro *m = macro_find(arg);
+
+		if (!m) {
+			ctl_reply(c, "ERR no macro %s\n", arg);
+			return;
+		}
+		ret = macro_play(c->dev, m);
+		if (ret)
+			ctl_reply(c, "ERR cannot play %s: %s\n", arg, strerror(-ret));
+	} else if ((!strcmp(line, "move") || !strcmp(line, "moveto") || !strcmp(line, "click") ||
+		    !strcmp(line, "button")) && !c->dev->pointer && !c->dev->capture) {
+		ctl_reply(c, "ERR %s needs a device with pointer\n", line);
+	} else if (!strcmp(line, "move") || !strcmp(line, "moveto")) {
+		char *save, *tok = strtok_r(arg, " \t", &save), *end = "";
+		long v[4] = { 0 };
+		int n = 0, d[4];
+
+		for (; tok && n < 4; tok = strtok_r(NULL, " \t", &save)) {
+			v[n++] = strtol(tok, &end, 10);
+			if (*end)
+				break;
+		}
+		if (!strcmp(line, "moveto")) {
+			if (*end || tok || n != 2 || v[0] < 0 || v[0] > POINTER_ABS_MAX ||
+			    v[1] < 0 || v[1] > POINTER_ABS_MAX) {
+				ctl_reply(c, "ERR usage: moveto X Y, 0-%d\n", POINTER_ABS_MAX);
+				return;
+			}
+			ret = pointer_moveto(c->dev, v[0], v[1]);
+			if (ret)
+				ctl_reply(c, "ERR cannot move: %s\n", strerror(-ret));
+			return;
+		}
+		for (i = 0; i < 4; i++) {
+			if (v[i] < -POINTER_MOVE_MAX || v[i] > POINTER_MOVE_MAX)
+				break;
+			d[i] = v[i];
+		}
+		if (*end || tok || n < 2 || i < 4) {
+			ctl_reply(c, "ERR usage: move DX DY [WHEEL [PAN]]\n");
+			return;
+		}
+		ret = pointer_move(c->dev, d);
+		if (ret)
+			ctl_reply(c, "ERR cannot move: %s\n", strerror(-ret));
+	} else if (!strcmp(line, "click") || !strcmp(line, "button")) {
+		char *save, *name = strtok_r(arg, " \t", &save), *state = strtok_r(NULL, " \t", &save);
+		bool click = !strcmp(line, "click");
+		__u8 mask = 0;
+
+		if (!name && click)
+			name = "left";
+		for (i = 0; name && i < ARRAY_SIZE(pointer_buttons); i++) {
+			if (!strcasecmp(name, pointer_buttons[i].name))
+				mask = pointer_buttons[i].mask;
+		}
+		if (!mask) {
+			ctl_reply(c, "ERR unknown button %s\n", name ? name : "");
+			return;
+		}
+		if (click) {
+			ret = pointer_button(c->dev, mask, true, 0);
+			err = pointer_button(c->dev, mask, false, g_hold_ns);
+			ret = ret ? : err;
+		} else if (state && (!strcmp(state, "down") || !strcmp(state, "up"))) {
+			ret = pointer_button(c->dev, mask, state[0] == 'd', 0);
+		} else {
+			ctl_reply(c, "ERR usage: button BUTTON down|up\n");
+			return;
+		}
+		if (ret)
+			ctl_reply(c, "ERR cannot press %s: %s\n", name, strerror(-ret));
+	} else if (!strcmp(line, "delay") && c->dev->capture) {
+		c->dev->capture_delay_ns += strtoul(arg, NULL, 10) * 1000000ull;
+	} else if (!strcmp(line, "resend") && c->dev->capture) {
+		ctl_reply(c, "ERR resend cannot be used in a macro\n");
+	} else if (!strcmp(line, "resend")) {
+		ret = chord_end(c->dev, 0);
+		err = report_resend(c->dev);
+		ret = ret ? : err;
+		if (ret)
+			ctl_reply(c, "ERR cannot resend: %s\n", strerror(-ret));
+	} else if ((!strcmp(line, "hold") || !strcmp(line, "release")) && c->dev->capture) {
+		ctl_reply(c, "ERR %s cannot be used in a macro\n", line);
+	} else if (!strcmp(line, "hold")) {
+		char *save, *key = strtok_r(arg, " \t", &save);
+		char *ms = strtok_r(NULL, " \t", &save), *hz = strtok_r(NULL, " \t", &save);
+		unsigned long n_ms = 0, n_hz = 0;
+		char *end = "";
+
+		usage = key ? ctl_parse_key(key, &mods) : 0;
+		if (!usage) {
+			ctl_reply(c, "ERR unknown key %s\n", key ? key : "");
+			return;
+		}
+		if (ms)
+			n_ms = strtoul(ms, &end, 10);
+		if (!*end && hz)
+			n_hz = strtoul(hz, &end, 10);
+		if (*end || (hz && (!n_hz || n_hz > HOLD_HZ_MAX))) {
+			ctl_reply(c, "ERR usage: hold [MOD+]KEY [MS [HZ]], HZ 1-%d\n", HOLD_HZ_MAX);
+			return;
+		}
+		ret = hold_key(c->dev, usage, mods, n_ms, n_hz ? (1000 + n_hz / 2) / n_hz : 0);
+		if (ret)
+			ctl_reply(c, "ERR cannot hold %s: %s\n", key, strerror(-ret));
+	} else if (!strcmp(line, "release")) {
+		if (!*arg) {
+			hold_release_all(c->dev);
+			return;
+		}
+		usage = ctl_parse_key(arg, &mods);
+		if (!usage || !c->dev->holds[usage]) {
+			ctl_reply(c, "ERR %s is not held\n", arg);
+			return;
+		}
+		hold_release(c->dev->holds[usage]);
+	} else if (!strcmp(line, "leds") && c->dev->capture) {
+		ctl_reply(c, "ERR leds cannot be used in a macro\n");
+	} else if (!strcmp(line, "leds")) {
+		char buf[64];
+
+		if (!strcmp(arg, "watch") || !strcmp(arg, "unwatch")) {
+			if (c->peer) {
+				ctl_reply(c, "ERR leds %s needs a stream connection\n", arg);
+				return;
+			}
+			c->leds_watch = arg[0] == 'w' ? c->dev : NULL;
+			if (!c->leds_watch)
+				return;
+		} else if (*arg) {
+			ctl_reply(c, "ERR unknown leds argument %s\n", arg);
+			return;
+		}
+		ctl_reply(c, "LEDS %s\n", c->dev->leds_known ?
+			  leds_str(c->dev->leds, buf, sizeof(buf)) : "unknown");
+	} else if (!strcmp(line, "dev") && c->dev && c->dev->capture) {
+		ctl_reply(c, "ERR dev cannot be used in a macro\n");
+	} else if (!strcmp(line, "dev")) {
+		struct uhid_dev *dev = NULL;
+		char *end;
+		long n = strtol(arg, &end, 10);
+
+		if (*arg && !*end && n >= 0 && n < n_devs)
+			dev = devs[n];
+		for (int j = 0; !dev && j < n_devs; j++) {
+			if (!strcmp(arg, devs[j]->name))
+				dev = devs[j];
+		}
+		c->dev = dev;
+		if (!dev)
+			ctl_reply(c, "ERR no device %s\n", arg);
+	} else {
+		ctl_reply(c, "ERR unknown command %s\n", line);
+	}
+}
+
+/*
+ * Run the complete lines of @len bytes at @buf; returns how many bytes of
+ * a trailing partial line were left over
+ */
+static size_t ctl_process(struct ctl_client *c, char *buf, size_t len)
+{
+	char *p = buf, *nl;
+
+	while ((nl = memchr(p, '\n', buf + len - p))) {
+		*nl = '\0';
+		if (nl > p && nl[-1] == '\r')
+			nl[-1] = '\0';
+		ctl_command(c, p);
+		p = nl + 1;
+	}
+	for (int i = 0; i < n_devs; i++) {
+		int ret = keys_flush(devs[i]);
+
+		if (ret)
+			ctl_reply(c, "ERR cannot send to %s: %s\n", devs[i]->name, strerror(-ret));
+	}
+	return buf + len - p;
+}
+
+static void ctl_close(int idx)
+{
+	struct ctl_client *c = clients[idx];
+
+	log_info("Control client %d disconnected\n", idx);
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c);
+	clients[idx] = NULL;
+}
+
+static void ctl_read(int idx)
+{
+	struct ctl_client *c = clients[idx];
+	char buf[16 * 1024 + CTL_LINE_MAX];
+	size_t left;
+	ssize_t ret;
+
+	if (c->binary) {
+		ret = read(c->fd, buf, sizeof(buf));
+		if (ret > 0)
+			bin_input(&c->bin, buf, ret);
+		else if (!ret || (errno != EINTR && errno != EAGAIN))
+			ctl_close(idx);
+		return;
+	}
+
+	/* Prepend what is left of the last read */
+	memcpy(buf, c->buf, c->len);
+	ret = read(c->fd, buf + c->len, sizeof(buf) - CTL_LINE_MAX);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		ctl_close(idx);
+		return;
+	}
+	/* Nothing is carried over meanwhile, the remainder starts at buf */
+	if (c->discard) {
+		char *nl = memchr(buf, '\n', ret);
+
+		if (!nl)
+			return;
+		c->discard = false;
+		ret -= nl + 1 - buf;
+		memmove(buf, nl + 1, ret);
+	}
+
+	left = ctl_process(c, buf, c->len + ret);
+	if (left >= CTL_LINE_MAX) {
+		/* Its end must not run as a command of its own */
+		ctl_reply(c, "ERR line too long\n");
+		c->discard = true;
+		left = 0;
+	}
+	memcpy(c->buf, buf + c->len + ret - left, left);
+	c->len = left;
+}
+
+/* Take every datagram that is queued, each one a batch of command lines */
+static void ctl_recv_dgrams(struct ctl_listener *l)
+{
+	struct sockaddr_storage peer;
+	struct ctl_client c = { .fd = l->fd, .peer = (struct sockaddr *)&peer };
+	char buf[CTL_LINE_MAX * 8 + 1];
+	ssize_t ret;
+
+	for (;;) {
+		c.peer_len = sizeof(peer);
+		ret = recvfrom(l->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT,
+			       (struct sockaddr *)&peer, &c.peer_len);
+		if (ret < 0)
+			break;
+		if (l->binary) {
+			struct bin_stream bs = { .dev = devs[0] };
+
+			bin_input(&bs, buf, ret);
+			if (bs.len)
+				log_warn("Dropping %zu trailing bytes of a datagram\n", bs.len);
+			continue;
+		}
+		/* The last line of a datagram needs no newline */
+		if (!ret || buf[ret - 1] != '\n')
+			buf[ret++] = '\n';
+		c.dev = devs[0];
+		ctl_process(&c, buf, ret);
+	}
+}
+
+/* Serve the connected stream socket @fd; its index, or -1 if it was closed */
+static int ctl_client_add(int fd, const char *spec, bool binary)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct ctl_client *c;
+	int idx;
+
+	for (idx = 0; idx < CTL_MAX_CLIENTS && clients[idx]; idx++)
+		;
+	c = idx < CTL_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+	if (!c) {
+		log_warn("Rejecting control client on %s\n", spec);
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	c->dev = devs[0];
+	c->binary = binary;
+	c->bin.dev = devs[0];
+	ev.data.u64 = EP_TAG(idx, SRC_CLIENT);
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		free(c);
+		return -1;
+	}
+	clients[idx] = c;
+	log_info("Control client %d connected on %s\n", idx, spec);
+	return idx;
+}
+
+/* Tell the clients that watch the LEDs of @dev about their new state */
+static void ctl_leds_changed(struct uhid_dev *dev)
+{
+	char buf[64];
+
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (clients[i] && clients[i]->leds_watch == dev)
+			ctl_reply(clients[i], "LEDS %s\n", leds_str(dev->leds, buf, sizeof(buf)));
+	}
+}
+
+static int ctl_clients(void)
+{
+	int n = 0;
+
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++)
+		n += clients[i] != NULL;
+	return n;
+}
+
+static void ctl_accept(struct ctl_listener *l)
+{
+	int fd;
+
+	fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd >= 0)
+		ctl_client_add(fd, l->spec, l->binary);
+}
+
+/*
+ * Macro files
+ * "[NAME]" or "[NAME KEY]" starts a macro, KEY being an escape sequence
+ * key in the syntax of the key command (f9, ctrl+shift+up) that plays the
+ * macro instead of itself. The lines up to the next header are control
+ * commands. "delay MS" adds a pause before the next report and "macro
+ * NAME" inlines an earlier macro. They run on a scratch device whose
+ * reports are recorded instead of sent.
+ */
+static bool g_macro_gaps = false;	/* some macro needs the pacing queue */
+
+static void macro_finish(struct uhid_dev *scratch)
+{
+	struct macro *m = scratch->capture;
+
+	if (!m)
+		return;
+	keys_flush(scratch);
+	scratch->capture = NULL;
+	for (size_t i = 0; i < m->len; i++) {
+		if (m->seq[i].gap_ns)
+			g_macro_gaps = true;
+	}
+	log_info("Macro %s: %zu reports\n", m->name, m->len);
+	/* Only now visible to macro_find(), so it cannot inline itself */
+	n_macros++;
+}
+
+static int macro_load(const char *path)
+{
+	struct ctl_client c = { .fd = -1 };
+	char line[CTL_LINE_MAX], *name, *trig;
+	struct macro *m;
+	int lineno = 0, ret = 0;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		log_error("Cannot open macros %s: %m\n", path);
+		return -errno;
+	}
+	c.dev = dev_alloc("macro", 0, 0);
+	if (!c.dev) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	while (!ret && fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '[') {
+			char *cmd = line + strspn(line, " \t");
+
+			if (c.dev->capture)
+				ctl_command(&c, cmd);
+			else if (cmd[0] && cmd[0] != '#')
+				log_warn("%s:%d: command outside of a macro\n", path, lineno);
+			continue;
+		}
+
+		macro_finish(c.dev);
+		if (n_macros == MACRO_MAX) {
+			log_error("%s:%d: too many macros, at most %d\n", path, lineno, MACRO_MAX);
+			ret = -ENOSPC;
+			break;
+		}
+		m = &macros[n_macros];
+		name = strtok(line + 1, " \t]");
+		trig = strtok(NULL, " \t]");
+		if (!name) {
+			log_error("%s:%d: macro without a name\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+		snprintf(m->name, sizeof(m->name), "%s", name);
+		if (trig) {
+			m->trig_usage = ctl_parse_key(trig, &m->trig_mods);
+			if (!m->trig_usage) {
+				log_error("%s:%d: unknown trigger key %s\n", path, lineno, trig);
+				ret = -EINVAL;
+				break;
+			}
+		}
+		c.dev->capture = m;
+	}
+	if (!ret)
+		macro_finish(c.dev);
+
+	dev_free(c.dev);
+	fclose(f);
+	return ret;
+}
+
+/* The code point @s stands for in a layout file, or -1 */
+static int32_t layout_char(const char *s)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	size_t len = u[0] < 0x80 ? 1 : u[0] >= 0xf0 ? 4 : u[0] >= 0xe0 ? 3 : u[0] >= 0xc2 ? 2 : 0;
+	uint32_t cp;
+	char *end;
+
+	if ((s[0] == 'U' || s[0] == 'u') && s[1] == '+' && s[2]) {
+		cp = strtoul(s + 2, &end, 16);
+		return *end || cp > 0x10ffff ? -1 : (int32_t)cp;
+	}
+	if (!len || strlen(s) != len)
+		return -1;
+	cp = len == 1 ? u[0] : u[0] & (0x3f >> (len - 1));
+	for (size_t i = 1; i < len; i++) {
+		if ((u[i] & 0xc0) != 0x80)
+			return -1;
+		cp = cp << 6 | (u[i] & 0x3f);
+	}
+	if (cp < utf8_min[len] || cp > 0x10ffff || (cp >= 0xd800 && cp < 0xe000))
+		return -1;
+	return cp;
+}
+
+static int layout_bucket_cmp(const void *a, const void *b)
+{
+	unsigned int ba = layout_bucket(((const struct layout_astral *)a)->cp);
+	unsigned int bb = layout_bucket(((const struct layout_astral *)b)->cp);
+
+	return ba < bb ? -1 : ba > bb;
+}
+
+/*
+ * Build the perfect hash of the @n code points at @list, "hash and
+ * displace" style: the code points are split into buckets of about four,
+ * and bucket by bucket, largest first, each gets the first displacement
+ * that puts all of its code points into free slots of a table twice their
+ * number. Sorts @list by bucket.
+ */
+static int layout_hash(struct layout_astral *list, size_t n)
+{
+	size_t *start, max_len = 0, b, k;
+	unsigned int slot, d = 0;
+
+	for (g_layout.astral_bits = 1; (1u << g_layout.astral_bits) < 2 * n; g_layout.astral_bits++)
+		;
+	for (g_layout.disp_bits = 1; (1u << g_layout.disp_bits) < n / 4; g_layout.disp_bits++)
+		;
+	g_layout.astral = calloc(1u << g_layout.astral_bits, sizeof(*g_layout.astral));
+	g_layout.disp = calloc(1u << g_layout.disp_bits, sizeof(*g_layout.disp));
+	start = calloc((1u << g_layout.disp_bits) + 1, sizeof(*start));
+	if (!g_layout.astral || !g_layout.disp || !start) {
+		free(start);
+		return -ENOMEM;
+	}
+
+	qsort(list, n, sizeof(*list), layout_bucket_cmp);
+	for (k = 0; k < n; k++)
+		start[layout_bucket(list[k].cp) + 1]++;
+	for (b = 0; b < 1u << g_layout.disp_bits; b++) {
+		if (start[b + 1] > max_len)
+			max_len = start[b + 1];
+		start[b + 1] += start[b];
+	}
+
+	for (size_t len = max_len; len && d <= UINT16_MAX; len--) {
+		for (b = 0; b < 1u << g_layout.disp_bits; b++) {
+			struct layout_astral *m = &list[start[b]];
+
+			if (start[b + 1] - start[b] != len)
+				continue;
+			for (d = 0; d <= UINT16_MAX; d++) {
+				for (k = 0; k < len; k++) {
+					slot = layout_slot(m[k].cp, d);
+					if (g_layout.astral[slot].cp)
+						break;
+					g_layout.astral[slot] = m[k];
+				}
+				if (k == len)
+					break;
+				while (k--)
+					g_layout.astral[layout_slot(m[k].cp, d)].cp = 0;
+			}
+			if (d > UINT16_MAX)
+				break;
+			g_layout.disp[b] = d;
+		}
+	}
+	free(start);
+	return d > UINT16_MAX ? -E2BIG : 0;
+}
+
+static int layout_load(const char *path)
+{
+	struct layout_astral *astral = NULL, *grown;
+	size_t n_astral = 0, n = 0;
+	char line[256], *tok[4];
+	struct layout_key key;
+	int lineno = 0, ret = 0;
+	int32_t cp;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		log_error("Cannot open layout %s: %m\n", path);
+		return -errno;
+	}
+	g_layout.bmp = calloc(0x10000, sizeof(*g_layout.bmp));
+	if (!g_layout.bmp) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	while (!ret && fgets(line, sizeof(line), f)) {
+		int n_tok = 0;
+
+		lineno++;
+		/* Up to a comment, which may also follow the keys */
+		for (char *t = strtok(line, " \t\r\n"); t && t[0] != '#' && n_tok < 4;
+		     t = strtok(NULL, " \t\r\n"))
+			tok[n_tok++] = t;
+		if (!n_tok)
+			continue;
+		cp = layout_char(tok[0]);
+		if (n_tok < 2 || n_tok > 3 || cp < 0) {
+			log_error("%s:%d: expected CHAR [MOD+]KEY [[MOD+]DEADKEY]\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+		memset(&key, 0, sizeof(key));
+		key.usage = ctl_parse_key(tok[1], &key.mods);
+		if (n_tok >= 3)
+			key.dead_usage = ctl_parse_key(tok[2], &key.dead_mods);
+		if (!key.usage || (n_tok >= 3 && !key.dead_usage)) {
+			log_error("%s:%d: unknown key %s\n", path, lineno,
+				  key.usage ? tok[2] : tok[1]);
+			ret = -EINVAL;
+			break;
+		}
+
+		n++;
+		if (cp < 0x10000) {
+			g_layout.bmp[cp] = key;
+			continue;
+		}
+		for (size_t i = 0; i < n_astral; i++) {
+			if (astral[i].cp == (uint32_t)cp) {
+				astral[i].key = key;
+				cp = -1;
+			}
+		}
+		if (cp < 0)
+			continue;
+		grown = realloc(astral, (n_astral + 1) * sizeof(*astral));
+		if (!grown) {
+			ret = -ENOMEM;
+			break;
+		}
+		astral = grown;
+		astral[n_astral].cp = cp;
+		astral[n_astral++].key = key;
+	}
+	fclose(f);
+
+	if (!ret && n_astral)
+		ret = layout_hash(astral, n_astral);
+	free(astral);
+	if (ret) {
+		if (ret == -E2BIG || ret == -ENOMEM)
+			log_error("Cannot build the layout table of %s: %s\n", path, strerror(-ret));
+		free(g_layout.bmp);
+		free(g_layout.astral);
+		free(g_layout.disp);
+		memset(&g_layout, 0, sizeof(g_layout));
+		return ret;
+	}
+	log_info("Layout %s: %zu characters, %zu beyond the BMP in %u slots\n", path, n,
+		 n_astral, n_astral ? 1u << g_layout.astral_bits : 0);
+	return 0;
+}
+
+/* A listener spec ending in ",binary" takes struct bin_record framing */
+static bool ctl_spec_binary(const char *spec)
+{
+	size_t len = strlen(spec);
+
+	return len > 7 && !strcmp(spec + len - 7, ",binary");
+}
+
+/* Whether @sa is 0.0.0.0 or ::, i.e. every interface */
+static bool ctl_addr_any(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return ((const struct sockaddr_in *)sa)->sin_addr.s_addr == htonl(INADDR_ANY);
+	return sa->sa_family == AF_INET6 &&
+	       IN6_IS_ADDR_UNSPECIFIED(&((const struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+/*
+ * A socket for unix:PATH, tcp:[HOST:]PORT or udp:[HOST:]PORT: bound and
+ * listening for --listen, connected for --connect. Stream sockets only
+ * listen, datagram ones are just bound. Without HOST both ends use the
+ * loopback address; anyone who reaches a listener can type, so every
+ * interface takes an explicit 0.0.0.0 or ::.
+ */
+static int ctl_socket(const char *addr, const char *spec, bool server, bool *dgram)
+{
+	struct addrinfo hints = { 0 }, *res, *ai;
+	int flags = SOCK_CLOEXEC | (server ? SOCK_NONBLOCK : 0);
+	const char *what = server ? "listen on" : "connect to";
+	char host[256], *port;
+	int fd, ret, one = 1;
+
+	*dgram = false;
+	if (!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+			log_error("Socket path too long: %s\n", addr + 5);
+			return -ENAMETOOLONG;
+		}
+		strcpy(sun.sun_path, addr + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+		if (fd < 0)
+			return -errno;
+		if (server)
+			unlink(sun.sun_path);
+		if (server ? bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16) :
+			     connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			ret = -errno;
+			log_error("Cannot %s %s: %m\n", what, spec);
+			close(fd);
+			return ret;
+		}
+		return fd;
+	} else if (strncmp(addr, "tcp:", 4) && strncmp(addr, "udp:", 4)) {
+		log_error("Unknown address %s\n", spec);
+		return -EINVAL;
+	}
+
+	*dgram = addr[0] == 'u';
+	hints.ai_socktype = *dgram ? SOCK_DGRAM : SOCK_STREAM;
+	snprintf(host, sizeof(host), "%s", addr + 4);
+	port = strrchr(host, ':');
+	if (port)
+		*port++ = '\0';
+	else
+		port = host;
+	if (getaddrinfo(port == host ? NULL : host, port, &hints, &res)) {
+		log_error("Cannot resolve %s\n", spec);
+		return -EINVAL;
+	}
+	/* Loopback may be ::1 or 127.0.0.1 only, take the first that works */
+	for (fd = -1, ret = -EADDRNOTAVAIL, ai = res; fd < 0 && ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | flags, 0);
+		if (fd >= 0 && server) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) || (!*dgram && listen(fd, 16))) {
+				ret = -errno;
+				close(fd);
+				fd = -1;
+			} else if (ctl_addr_any(ai->ai_addr)) {
+				log_warn("%s is open to every network interface\n", spec);
+			}
+		} else if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			ret = -errno;
+			close(fd);
+			fd = -1;
+		} else if (fd < 0) {
+			ret = -errno;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		log_error("Cannot %s %s: %s\n", what, spec, strerror(-ret));
+		return ret;
+	}
+	return fd;
+}
+
+/* Take @fd as listener number n_listeners, watched by the epoll set */
+static int ctl_listener_add(int fd, const char *spec, bool dgram, bool binary)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct ctl_listener *l = &listeners[n_listeners];
+
+	ev.data.u64 = EP_TAG(n_listeners, SRC_LISTEN);
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev))
+		return -errno;
+	l->fd = fd;
+	l->spec = spec;
+	l->dgram = dgram;
+	l->binary = binary;
+	n_listeners++;
+	log_info("Listening for commands on %s\n", spec);
+	return 0;
+}
+
+/* Open a listener for unix:PATH, tcp:[HOST:]PORT or udp:[HOST:]PORT */
+static int ctl_listen(const char *spec)
+{
+	char addr[256];
+	bool binary = false, dgram;
+	int fd, ret;
+
+	if (n_listeners == CTL_MAX_LISTEN) {
+		log_error("Too many listeners, at most %d\n", CTL_MAX_LISTEN);
+		return -ENOSPC;
+	}
+	snprintf(addr, sizeof(addr), "%s", spec);
+	if (ctl_spec_binary(addr)) {
+		addr[strlen(addr) - 7] = '\0';
+		binary = true;
+	}
+
+	fd = ctl_socket(addr, spec, true, &dgram);
+	if (fd < 0)
+		return fd;
+	ret = ctl_listener_add(fd, spec, dgram, binary);
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+	if (!strncmp(addr, "unix:", 5))
+		strcpy(listeners[n_listeners - 1].path, addr + 5);
+	return 0;
+}
+
+/*
+ * systemd socket activation
+ * Sockets passed in as LISTEN_FDS take commands like --listen ones. A
+ * socket whose FileDescriptorName= ends in "binary" takes records. With
+ * Accept=yes every connection comes as an already connected stream
+ * socket, which becomes a control client of its own.
+ */
+#define SD_LISTEN_FDS_START 3
+
+static bool ctl_fdname_binary(const char *name, size_t len)
+{
+	return len >= 6 && !memcmp(name + len - 6, "binary", 6);
+}
+
+/* Whether ctl_inherit() will take a socket for records, which need pacing */
+static bool ctl_inherit_binary(void)
+{
+	const char *pid = getenv("LISTEN_PID"), *name = getenv("LISTEN_FDNAMES");
+	size_t len;
+
+	if (!pid || !name || strtol(pid, NULL, 10) != getpid())
+		return false;
+	for (; *name; name += len + !!name[len]) {
+		len = strcspn(name, ":");
+		if (ctl_fdname_binary(name, len))
+			return true;
+	}
+	return false;
+}
+
+static int ctl_inherit(void)
+{
+	static char names[CTL_MAX_LISTEN + CTL_MAX_CLIENTS][64];
+	const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+	char *fdnames = getenv("LISTEN_FDNAMES");
+	char *name, *save = NULL;
+	int n, type, listening, ret;
+	socklen_t len;
+
+	if (!pid || !fds || strtol(pid, NULL, 10) != getpid())
+		return 0;
+	n = strtol(fds, NULL, 10);
+	fdnames = fdnames ? strdup(fdnames) : NULL;
+	name = fdnames ? strtok_r(fdnames, ":", &save) : NULL;
+	ret = 0;
+	for (int i = 0; i < n && !ret && i < (int)ARRAY_SIZE(names); i++) {
+		int fd = SD_LISTEN_FDS_START + i;
+		bool binary = name && ctl_fdname_binary(name, strlen(name));
+
+		snprintf(names[i], sizeof(names[i]), "fd %d (%s)", fd, name ? name : "systemd");
+		name = name ? strtok_r(NULL, ":", &save) : NULL;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		len = sizeof(type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)) {
+			log_error("Inherited %s is not a socket\n", names[i]);
+			ret = -ENOTSOCK;
+			break;
+		}
+		len = sizeof(listening);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len))
+			listening = 0;
+		if (type == SOCK_STREAM && !listening)
+			ret = ctl_client_add(fd, names[i], binary) < 0 ? -ENOSPC : 0;
+		else if (n_listeners == CTL_MAX_LISTEN)
+			ret = -ENOSPC;
+		else
+			ret = ctl_listener_add(fd, names[i], type == SOCK_DGRAM, binary);
+	}
+	free(fdnames);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	if (ret)
+		log_error("Cannot take inherited sockets: %s\n", strerror(-ret));
+	return ret;
+}
+
+/* Tell a Type=notify service manager that the devices are up */
+static void notify_ready(void)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	socklen_t len;
+	int fd;
+
+	if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(sun.sun_path))
+		return;
+	strcpy(sun.sun_path, path);
+	if (path[0] == '@')
+		sun.sun_path[0] = '\0';	/* abstract namespace */
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if (sendto(fd, "READY=1", 7, MSG_NOSIGNAL, (struct sockaddr *)&sun, len) < 0)
+		log_warn("Cannot notify %s: %m\n", path);
+	close(fd);
+}
+
+/*
+ * Metrics export
+ * --metrics=unix:PATH answers every connection with the current metrics
+ * and closes it, so that "socat - UNIX:PATH" prints them. With
+ * --metrics=tcp:[HOST:]PORT it speaks just enough HTTP for a Prometheus
+ * scrape: any request gets the metrics once its header is complete.
+ * SIGUSR1 dumps the same text to stderr. Device gauges are read from the
+ * main thread, which is where all of this runs.
+ */
+#define METRICS_MAX_CONNS 8
+
+struct metrics_conn {
+	int fd;		/* -1 when unused */
+	size_t len;
+	char req[1024];	/* HTTP request header read so far */
+};
+
+static int g_metrics_fd = -1;	/* --metrics listener */
+static bool g_metrics_http;
+static char g_metrics_path[108];
+static struct metrics_conn metrics_conns[METRICS_MAX_CONNS];
+static int g_sigfd = -1;	/* SIGUSR1 */
+
+static void metrics_counter(FILE *f, const char *name, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+}
+
+/* One sample of @name labelled @labels and with the name of @dev */
+static void metrics_dev(FILE *f, const char *name, const char *labels,
+			const struct uhid_dev *dev, uint64_t v)
+{
+	fprintf(f, "%s{%sdevice=\"", name, labels);
+	for (const char *c = dev->name; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fputc('\\', f);
+		if (*c == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*c, f);
+	}
+	fprintf(f, "\"} %" PRIu64 "\n", v);
+}
+
+/*
+ * Histogram @h with cumulative buckets at 2^lo - 1 ... 2^hi - 1; these fall
+ * on bucket boundaries, so the counts are exact. Values are multiplied by
+ * @scale, and a comment gives the quantiles for people reading the dump.
+ */
+static void metrics_hist(FILE *f, const char *name, const char *help, struct hist *h,
+			 int lo, int hi, double scale)
+{
+	uint64_t cum = 0;
+	unsigned int i = 0;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (int e = lo; e <= hi; e++) {
+		for (; i < HIST_BUCKETS && hist_upper(i) < (1ull << e); i++)
+			cum += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+		fprintf(f, "%s_bucket{le=\"%.10g\"} %" PRIu64 "\n", name,
+			((1ull << e) - 1) * scale, cum);
+	}
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, atomic_load(&h->count));
+	fprintf(f, "%s_sum %g\n", name, atomic_load(&h->sum) * scale);
+	fprintf(f, "%s_count %llu\n", name, atomic_load(&h->count));
+	fprintf(f, "# %s p50 %g p99 %g p99.9 %g\n", name, hist_quantile(h, 0.5) * scale,
+		hist_quantile(h, 0.99) * scale, hist_quantile(h, 0.999) * scale);
+}
+
+static void metrics_print(FILE *f)
+{
+	metrics_counter(f, "uhid_reports_total", "Input reports written to uhid");
+	for (int id = 1; id < REPORT_ID_COUNT; id++)
+		fprintf(f, "uhid_reports_total{report_id=\"%d\"} %llu\n", id,
+			atomic_load(&metrics.reports[id]));
+	metrics_counter(f, "uhid_written_bytes_total", "Bytes of input reports written to uhid");
+	fprintf(f, "uhid_written_bytes_total %llu\n", atomic_load(&metrics.bytes));
+	metrics_counter(f, "uhid_unknown_chars_total", "Input characters without a key");
+	fprintf(f, "uhid_unknown_chars_total %llu\n", atomic_load(&metrics.unknown_chars));
+	metrics_counter(f, "uhid_escape_dropped_total",
+			"Escape sequences ignored or cut short");
+	fprintf(f, "uhid_escape_dropped_total %llu\n", atomic_load(&metrics.esc_dropped));
+	metrics_counter(f, "uhid_pacing_dropped_total",
+			"Reports dropped because the pacing queue was full");
+	fprintf(f, "uhid_pacing_dropped_total %llu\n", atomic_load(&metrics.sched_dropped));
+
+	metrics_counter(f, "uhid_duplicate_reports_total",
+			"Reports identical to the previous one that were not sent");
+	for (int i = 0; i < n_devs; i++)
+		metrics_dev(f, "uhid_duplicate_reports_total", "", devs[i], devs[i]->dup_reports);
+	metrics_counter(f, "uhid_overflow_dropped_total",
+			"Reports lost to the --nonblock overflow policy");
+	for (int i = 0; i < n_devs; i++)
+		metrics_dev(f, "uhid_overflow_dropped_total", "", devs[i], devs[i]->out_dropped);
+	fprintf(f, "# HELP uhid_queue_depth Reports waiting, by queue\n"
+		   "# TYPE uhid_queue_depth gauge\n");
+	for (int i = 0; i < n_devs; i++) {
+		metrics_dev(f, "uhid_queue_depth", "queue=\"pacing\",", devs[i], sched_len(devs[i]));
+		metrics_dev(f, "uhid_queue_depth", "queue=\"outbound\",", devs[i], out_len(devs[i]));
+	}
+	if (g_writer)
+		fprintf(f, "uhid_queue_depth{queue=\"writer\"} %u\n",
+			atomic_load(&g_writer->head) - atomic_load(&g_writer->tail));
+
+	metrics_hist(f, "uhid_write_seconds", "Time per write to uhid",
+		     &metrics.write_ns, 10, 30, 1e-9);
+	metrics_hist(f, "uhid_write_reports", "Reports per write to uhid",
+		     &metrics.write_reports, 0, 9, 1);
+	metrics_hist(f, "uhid_input_read_bytes", "Bytes taken from an input at a time",
+		     &metrics.input_bytes, 0, 17, 1);
+}
+
+/* The metrics, behind an HTTP response header if @http */
+static char *metrics_render(bool http, size_t *len)
+{
+	char *body = NULL, *buf = NULL;
+	size_t body_len;
+	FILE *f;
+
+	f = open_memstream(&body, &body_len);
+	if (!f)
+		return NULL;
+	metrics_print(f);
+	if (fclose(f))
+		return NULL;
+	if (!http) {
+		*len = body_len;
+		return body;
+	}
+	f = open_memstream(&buf, len);
+	if (f) {
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+			   "Content-Type: text/plain; version=0.0.4\r\n"
+			   "Content-Length: %zu\r\n"
+			   "Connection: close\r\n\r\n", body_len);
+		fwrite(body, 1, body_len, f);
+		if (fclose(f)) {
+			free(buf);
+			buf = NULL;
+		}
+	}
+	free(body);
+	return buf;
+}
+
+/* Send the metrics to @fd and close it; a peer gets a second to take them */
+static void metrics_reply(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	size_t len = 0, off = 0;
+	char *buf = metrics_render(g_metrics_http, &len);
+	ssize_t ret;
+
+	while (buf && off < len) {
+		ret = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (ret > 0)
+			off += ret;
+		else if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret == 0 || errno != EAGAIN || poll(&pfd, 1, 1000) <= 0)
+			break;
+	}
+	free(buf);
+	close(fd);
+}
+
+static void metrics_close(int idx)
+{
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, metrics_conns[idx].fd, NULL);
+	close(metrics_conns[idx].fd);
+	metrics_conns[idx].fd = -1;
+}
+
+static void metrics_accept(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int fd, idx;
+
+	fd = accept4(g_metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (!g_metrics_http) {
+		metrics_reply(fd);
+		return;
+	}
+	for (idx = 0; idx < METRICS_MAX_CONNS && metrics_conns[idx].fd >= 0; idx++)
+		;
+	ev.data.u64 = EP_TAG(idx, SRC_METRICS_CLIENT);
+	if (idx == METRICS_MAX_CONNS || epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return;
+	}
+	metrics_conns[idx].fd = fd;
+	metrics_conns[idx].len = 0;
+}
+
+/* Read more of an HTTP request, answering it once the header is complete */
+static void metrics_read(int idx)
+{
+	struct metrics_conn *c = &metrics_conns[idx];
+	ssize_t ret;
+
+	ret = read(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		metrics_close(idx);
+		return;
+	}
+	c->len += ret;
+	c->req[c->len] = '\0';
+	if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") &&
+	    c->len < sizeof(c->req) - 1)
+		return;
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	metrics_reply(c->fd);
+	c->fd = -1;
+}
+
+/* Serve the metrics on unix:PATH or tcp:[HOST:]PORT */
+static int metrics_listen(const char *spec)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EP_TAG(0, SRC_METRICS) };
+	bool dgram;
+	int fd;
+
+	if (!strncmp(spec, "udp:", 4)) {
+		log_error("Metrics need a stream socket, not %s\n", spec);
+		return -EINVAL;
+	}
+	fd = ctl_socket(spec, spec, true, &dgram);
+	if (fd < 0)
+		return fd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return -errno;
+	}
+	for (int i = 0; i < METRICS_MAX_CONNS; i++)
+		metrics_conns[i].fd = -1;
+	g_metrics_fd = fd;
+	g_metrics_http = !strncmp(spec, "tcp:", 4);
+	if (!strncmp(spec, "unix:", 5))
+		strcpy(g_metrics_path, spec + 5);
+	log_info("Serving metrics on %s\n", spec);
+	return 0;
+}
+
+/*
+ * Dump the metrics on SIGUSR1. The signal is blocked in every thread and
+ * read from a signalfd in the epoll set, so this runs in the main loop.
+ */
+static int metrics_signal_setup(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EP_TAG(0, SRC_SIGNAL) };
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL))
+		return -errno;
+	g_sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (g_sigfd < 0 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_sigfd, &ev)) {
+		log_error("Cannot watch for SIGUSR1: %m\n");
+		return -errno;
+	}
+	return 0;
+}
+
+static void metrics_signal(void)
+{
+	struct signalfd_siginfo si;
+	size_t len;
+	char *buf;
+
+	while (read(g_sigfd, &si, sizeof(si)) == sizeof(si)) {
+		buf = metrics_render(false, &len);
+		if (!buf)
+			continue;
+		log_drain();
+		log_write(buf, len);
+		free(buf);
+	}
+}
+
+static void metrics_exit(void)
+{
+	if (g_metrics_fd >= 0) {
+		for (int i = 0; i < METRICS_MAX_CONNS; i++) {
+			if (metrics_conns[i].fd >= 0)
+				metrics_close(i);
+		}
+		close(g_metrics_fd);
+		if (g_metrics_path[0])
+			unlink(g_metrics_path);
+	}
+	if (g_sigfd >= 0)
+		close(g_sigfd);
+}
+
+/*
+ * Client mode
+ * With --connect=ADDR nothing is created locally: the input (stdin or
+ * --input) goes to the control socket of a running instance instead,
+ * typically a --daemon that keeps its devices up, so a short-lived
+ * invocation skips device creation and driver binding altogether. Text is
+ * sent as type commands with everything but printable ASCII escaped,
+ * binary input (--binary) as is. --device NAME selects the device of the
+ * daemon to type on. Error replies are copied to stderr and fail the run.
+ */
+#define CLIENT_CHUNK 240	/* input bytes per type command, escaped fit in a line */
+
+/* Append "type @buf" to @out, escaped for ctl_unescape() */
+static size_t client_type_line(char *out, const char *buf, size_t len)
+{
+	size_t n = sprintf(out, "type ");
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		if (c == '\\')
+			n += sprintf(out + n, "\\\\");
+		else if (c < 0x20 || c >= 0x7f)
+			n += sprintf(out + n, "\\x%02x", c);
+		else
+			out[n++] = c;
+	}
+	out[n++] = '\n';
+	return n;
+}
+
+/*
+ * How much of the @len bytes at @buf ends between two characters and
+ * outside escape sequences, by the rules of translate(). The daemon
+ * parses every type line afresh, so the rest has to wait for the next
+ * line. A lone ESC at the end only waits if @more input may follow
+ * right away: a terminal sends a sequence in one go, ESC by itself is
+ * the key.
+ */
+static size_t client_cut(const char *buf, size_t len, bool more)
+{
+	unsigned char state = ESC_GROUND, need = 0;
+	size_t cut = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		switch (state) {
+		case ESC_GROUND:
+			if (need && (c & 0xc0) == 0x80) {
+				if (!--need)
+					cut = i + 1;
+				break;
+			}
+			need = 0;
+			if (c == 27)
+				state = ESC_ESC;
+			else if (c >= 0xc2 && c <= 0xf4)
+				need = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : 1;
+			else
+				cut = i + 1;
+			break;
+		case ESC_ESC:
+			if (c == '[' || c == 'O') {
+				state = c == '[' ? ESC_CSI : ESC_SS3;
+				break;
+			}
+			state = ESC_GROUND;
+			cut = i--;
+			break;
+		case ESC_CSI:
+			if (c >= 0x40 && c <= 0x7e) {
+				state = ESC_GROUND;
+				cut = i + 1;
+			} else if (c < 0x20 || c == 0x7f) {
+				state = ESC_GROUND;
+				cut = i--;
+			}
+			break;
+		case ESC_SS3:
+			state = ESC_GROUND;
+			cut = i + 1;
+			break;
+		}
+	}
+	return state == ESC_ESC && !more ? len : cut;
+}
+
+static int client_send(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			log_error("Cannot send to daemon: %m\n");
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Copy what the daemon replied to stderr; -EPROTO if it reported errors */
+static int client_replies(int fd, bool wait)
+{
+	char buf[4096];
+	ssize_t ret;
+	int err = 0;
+
+	while ((ret = recv(fd, buf, sizeof(buf), wait ? 0 : MSG_DONTWAIT)) > 0) {
+		log_write(buf, ret);
+		if (memmem(buf, ret, "ERR", 3))
+			err = -EPROTO;
+	}
+	return err;
+}
+
+static int client_run(const char *spec, const struct uhid_dev *dev, const char *target)
+{
+	char in[INPUT_BUF_SIZE], out[CTL_LINE_MAX * 2], sel[160] = "";
+	size_t sel_len = 0, have = 0, off = 0, chunk, cut, n;
+	bool dgram, done = dev->in_done;
+	int fd, ret = 0, err = 0;
+	ssize_t len;
+
+	fd = ctl_socket(spec, spec, false, &dgram);
+	if (fd < 0)
+		return fd;
+	if (target && dev->in_binary)
+		log_warn("--device is ignored for binary input\n");
+	else if (target)
+		sel_len = snprintf(sel, sizeof(sel), "dev %s\n", target);
+	if (sel_len && !dgram)
+		ret = client_send(fd, sel, sel_len);
+
+	/* A datagram has to fit the daemon's buffer and hold whole records */
+	chunk = !dev->in_binary ? CLIENT_CHUNK :
+		dgram ? CTL_LINE_MAX * 8 / sizeof(struct bin_record) * sizeof(struct bin_record) :
+		sizeof(in);
+	while (!ret && !done) {
+		if (dev->map) {
+			len = dev->map_size - off < chunk - have ? dev->map_size - off : chunk - have;
+			memcpy(in + have, dev->map + off, len);
+			off += len;
+			done = off == dev->map_size;
+		} else {
+			len = read(dev->in_fd, in + have, chunk - have);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0) {
+				ret = -errno;
+				log_error("Cannot read input: %m\n");
+				break;
+			}
+			done = !len;
+		}
+		have += len;
+
+		if (dev->in_binary) {
+			n = dgram ? have - have % sizeof(struct bin_record) : have;
+			if (n)
+				ret = client_send(fd, in, n);
+			memmove(in, in + n, have - n);
+			have -= n;
+			continue;
+		}
+		if (!have)
+			continue;
+		/* Only a sequence as long as the whole chunk gets split */
+		cut = done ? have : client_cut(in, have, have == chunk);
+		if (!cut && have < chunk)
+			continue;
+		if (!cut)
+			cut = have;
+		/* The device selection of a datagram ends with it */
+		n = dgram ? sel_len : 0;
+		memcpy(out, sel, n);
+		n += client_type_line(out + n, in, cut);
+		memmove(in, in + cut, have - cut);
+		have -= cut;
+		ret = client_send(fd, out, n);
+		if (!ret && !dgram)
+			err = client_replies(fd, false) ? : err;
+	}
+	if (have)
+		log_warn("Dropping %zu trailing bytes of input\n", have);
+
+	if (!ret && !dgram) {
+		/* The daemon closes its end once it ran everything */
+		shutdown(fd, SHUT_WR);
+		err = client_replies(fd, true) ? : err;
+	}
+	close(fd);
+	return ret ? : err;
+}
+
+/*
+ * Benchmark mode
+ * --bench injects a synthetic key stream through process_input() in
+ * stdin-sized chunks, exactly as keyboard() would, and prints the report
+ * rate plus the latency distribution of the individual uhid writes. With
+ * --bench-evdev every character is sent on its own and timed until its key
+ * press arrives on the evdev node the kernel created for us.
+ * Note that the keys really are typed into whatever has the focus.
+ */
+static unsigned long g_bench_count = 0;	/* characters to inject, 0 = off */
+static const char *g_bench_text = "abcdefghijklmnopqrstuvwxyz";
+static bool g_bench_evdev = false;
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_print_lat(const char *what, uint32_t *lat, size_t n)
+{
+	if (!n)
+		return;
+	qsort(lat, n, sizeof(*lat), cmp_u32);
+	printf("%s: n=%zu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", what, n,
+	       lat[n * 50 / 100] / 1e3, lat[n * 99 / 100] / 1e3,
+	       lat[n * 999 / 1000] / 1e3, lat[n - 1] / 1e3);
+}
+
+/* Find the evdev node of our keyboard collection, newest one first */
+static int bench_open_evdev(struct uhid_dev *dev)
+{
+	const char *devname = dev->name;
+	size_t devlen = strlen(devname);
+	char name[256], path[64];
+	int best, ret;
+	glob_t g;
+
+	for (int tries = 0; tries < 40; tries++) {
+		best = -1;
+		if (!glob("/sys/class/input/event*/device/name", 0, NULL, &g)) {
+			for (size_t i = 0; i < g.gl_pathc; i++) {
+				FILE *f = fopen(g.gl_pathv[i], "re");
+				int num;
+
+				if (!f)
+					continue;
+				if (!fgets(name, sizeof(name), f))
+					name[0] = '\0';
+				fclose(f);
+				name[strcspn(name, "\n")] = '\0';
+				/* hid-input may suffix the name with the application */
+				if (strncmp(name, devname, devlen) ||
+				    (name[devlen] && strcmp(name + devlen, " Keyboard")))
+					continue;
+				if (sscanf(g.gl_pathv[i], "/sys/class/input/event%d/", &num) == 1 &&
+				    num > best)
+					best = num;
+			}
+			globfree(&g);
+		}
+		if (best >= 0)
+			break;
+		ret = uhid_service(dev, 50);
+		if (ret)
+			return ret;
+	}
+	if (best < 0) {
+		log_error("No evdev node found for %s\n", devname);
+		return -ENOENT;
+	}
+
+	snprintf(path, sizeof(path), "/dev/input/event%d", best);
+	ret = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (ret < 0) {
+		log_error("Cannot open %s: %m\n", path);
+		return -errno;
+	}
+	log_info("Timing round trips on %s\n", path);
+	return ret;
+}
+
+/*
+ * Wait until a key press shows up on @evfd and all keys are up again.
+ * Returns the time of the first press, 0 on timeout.
+ */
+static uint64_t bench_evdev_wait(struct uhid_dev *dev, int evfd)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = evfd, .events = POLLIN },
+		{ .fd = dev->fd, .events = POLLIN },
+	};
+	struct input_event iev[64];
+	uint64_t pressed = 0;
+	int down = 0;
+	ssize_t ret;
+
+	do {
+		ret = poll(pfds, 2, 1000);
+		if (ret <= 0)
+			return 0;
+		if (pfds[1].revents & POLLIN)
+			event(dev);
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+		ret = read(evfd, iev, sizeof(iev));
+		if (ret <= 0)
+			continue;
+		for (size_t i = 0; i < ret / sizeof(iev[0]); i++) {
+			if (iev[i].type != EV_KEY)
+				continue;
+			if (iev[i].value == 1) {
+				if (!pressed)
+					pressed = now_ns();
+				down++;
+			} else if (iev[i].value == 0 && down > 0) {
+				down--;
+			}
+		}
+	} while (!pressed || down > 0);
+
+	return pressed;
+}
+
+static int bench_run(struct uhid_dev *dev)
+{
+	struct bench_stats stats = { 0 };
+	size_t text_len = strlen(g_bench_text);
+	uint32_t *rtt = NULL;
+	size_t n_rtt = 0;
+	unsigned long sent = 0;
+	uint64_t t_start, t_total;
+	char chunk[128];
+	int evfd = -1, ret;
+
+	if (!text_len) {
+		log_error("Empty --bench-text\n");
+		return -EINVAL;
+	}
+	ret = wait_for_start(dev, START_TIMEOUT_MS);
+	if (ret)
+		return ret;
+	if (g_bench_evdev) {
+		evfd = bench_open_evdev(dev);
+		if (evfd < 0)
+			return evfd;
+		rtt = calloc(g_bench_count, sizeof(*rtt));
+	}
+
+	stats.cap_lat = g_bench_count * 2 + 16;
+	stats.lat = calloc(stats.cap_lat, sizeof(*stats.lat));
+	if (!stats.lat || (g_bench_evdev && !rtt)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	bench = &stats;
+
+	t_start = now_ns();
+	while (sent < g_bench_count) {
+		size_t n = g_bench_evdev ? 1 : sizeof(chunk);
+		uint64_t t0, t1;
+
+		if (n > g_bench_count - sent)
+			n = g_bench_count - sent;
+		for (size_t i = 0; i < n; i++)
+			chunk[i] = g_bench_text[(sent + i) % text_len];
+
+		if (g_pacing) {
+			ret = sched_wait_room(dev, 4 * sizeof(chunk));
+			if (ret)
+				break;
+		}
+		t0 = now_ns();
+		ret = process_input(dev, &dev->esc, chunk, n);
+		if (ret)
+			break;
+		if (evfd >= 0) {
+			t1 = bench_evdev_wait(dev, evfd);
+			if (!t1) {
+				log_error("No input event within 1s, is the device grabbed?\n");
+				ret = -ETIMEDOUT;
+				break;
+			}
+			rtt[n_rtt++] = t1 - t0;
+		} else if ((sent / sizeof(chunk)) % 64 == 0) {
+			ret = uhid_service(dev, 0);
+			if (ret)
+				break;
+		}
+		sent += n;
+	}
+	if (!ret && g_pacing)
+		ret = sched_wait_room(dev, SCHED_MAX);
+	if (!ret && g_nonblock)
+		ret = out_wait(dev, -1);
+	if (!ret)
+		ret = writer_drain();
+	t_total = now_ns() - t_start;
+	bench = NULL;
+
+	printf("bench: %lu chars, %" PRIu64 " reports in %" PRIu64 " writes, %.3f s\n",
+	       sent, stats.reports, stats.writes, t_total / 1e9);
+	printf("bench: %.0f reports/s, %.0f chars/s (batching %s)\n",
+	       stats.reports / (t_total / 1e9), sent / (t_total / 1e9),
+	       g_batch ? "on" : "off");
+	bench_print_lat("bench: uhid write latency", stats.lat, stats.n_lat);
+	bench_print_lat("bench: evdev round trip", rtt, n_rtt);
+
+out:
+	free(stats.lat);
+	free(rtt);
+	if (evfd >= 0)
+		close(evfd);
+	return ret;
+}
+
+/*
+ * Microbenchmarks (--microbench)
+ * Translate representative inputs into a sink: a device without a uhid fd,
+ * whose flushes only count the reports. Nothing is created, so this needs
+ * neither root nor /dev/uhid, and it times just the translator, the escape
+ * parser and the key state, under whatever --nkro, --coalesce or --layout
+ * say. Inputs go through process_input() in INPUT_BUF_SIZE reads as
+ * keyboard() would, repeated for at least MICROBENCH_NS per case.
+ */
+#define MICROBENCH_NS 250000000ull
+
+static size_t g_microbench_mb = 0;	/* size of the paste case, 0 = off */
+
+static uint32_t microbench_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* Fill @buf with @len bytes of pieces out of @pieces, picked at random */
+static void microbench_fill(char *buf, size_t len, const char *const *pieces, size_t n)
+{
+	uint32_t state = 2463534242u;
+	size_t off = 0, plen;
+
+	while (off < len) {
+		const char *p = pieces[microbench_rand(&state) % n];
+
+		plen = strlen(p);
+		if (plen > len - off)
+			plen = len - off;
+		memcpy(buf + off, p, plen);
+		off += plen;
+	}
+}
+
+static const char *const microbench_plain[] = {
+	"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ",
+	"and ", "keeps ", "typing ", "lines ", "of ", "text\n",
+};
+static const char *const microbench_escape[] = {
+	"\e[A", "\e[B", "\e[C", "\e[D", "\e[1;5C", "\e[1;2D", "\e[3~", "\e[5~",
+	"\e[15~", "\eOP", "\eOQ", "\e[H", "\e[F", "x",
+};
+static const char *const microbench_shifted[] = {
+	"!", "@", "#", "$", "%", "^", "&", "*", "(", ")", "_", "+", "{", "}",
+	"|", ":", "\"", "<", ">", "?", "~", "A", "Z", " ",
+};
+static const char *const microbench_paste[] = {
+	"The ", "kernel ", "hands ", "reports ", "on, ", "whether ", "or ", "not ",
+	"anyone ", "reads ", "them. ", "See ", "section 4.2 ", "(page 17). ",
+	"Note: ", "it's ", "\"fast\"; ", "100% ", "of ", "the ", "time!\n", "\t",
+};
+
+static int microbench_case(const char *name, const char *const *pieces, size_t n, size_t len,
+			   bool nkro)
+{
+	static struct uhid_dev dev __attribute__((aligned(64)));
+	char *buf = malloc(len);
+	uint64_t t0, elapsed = 0, bytes = 0, reports = 0;
+	unsigned long long before;
+	int ret = 0;
+
+	if (!buf)
+		return -ENOMEM;
+	microbench_fill(buf, len, pieces, n);
+
+	while (!ret && elapsed < MICROBENCH_NS) {
+		dev_init(&dev, "microbench", 0, 0);
+		dev.nkro = nkro;
+		before = 0;
+		for (int id = 0; id < REPORT_ID_COUNT; id++)
+			before += atomic_load(&metrics.reports[id]);
+
+		t0 = now_ns();
+		for (size_t off = 0; !ret && off < len; off += INPUT_BUF_SIZE)
+			ret = process_input(&dev, &dev.esc, buf + off,
+					    len - off < INPUT_BUF_SIZE ? len - off : INPUT_BUF_SIZE);
+		esc_expire(&dev, &dev.esc);
+		keys_flush(&dev);
+		elapsed += now_ns() - t0;
+
+		bytes += len;
+		for (int id = 0; id < REPORT_ID_COUNT; id++)
+			reports += atomic_load(&metrics.reports[id]);
+		reports -= before;
+	}
+	free(buf);
+	if (ret)
+		return ret;
+
+	printf("microbench: %-8s %8.1f MB/s %7.2f ns/byte %10" PRIu64 " reports %7.2f ns/report\n",
+	       name, bytes / (elapsed / 1e9) / 1e6, (double)elapsed / bytes, reports,
+	       reports ? (double)elapsed / reports : 0.0);
+	return 0;
+}
+
+static int microbench_run(bool nkro)
+{
+	const size_t small = 1 << 20;
+	int level = g_log_level, ret;
+
+	/* Warnings, say for characters --layout lacks, would be timed too */
+	g_log_level = LVL_ERROR;
+	ret = microbench_case("plain", microbench_plain, ARRAY_SIZE(microbench_plain), small, nkro);
+	if (!ret)
+		ret = microbench_case("escape", microbench_escape, ARRAY_SIZE(microbench_escape),
+				      small, nkro);
+	if (!ret)
+		ret = microbench_case("shifted", microbench_shifted, ARRAY_SIZE(microbench_shifted),
+				      small, nkro);
+	if (!ret)
+		ret = microbench_case("paste", microbench_paste, ARRAY_SIZE(microbench_paste),
+				      g_microbench_mb << 20, nkro);
+	g_log_level = level;
+	return ret;
+}
+#endif /* UHID_KBD_LIB */
+
+#ifdef UHID_FUZZ
+/*
+ * libFuzzer target: the first byte picks NKRO, --coalesce, --binary and the
+ * size of the reads the rest is cut into, so that sequences and records
+ * also get split at every point. A sink takes the reports. Text must not
+ * leave a key or modifier pressed once its last sequence expired; binary
+ * records may, that is what they say.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct uhid_dev dev __attribute__((aligned(64)));
+	static bool init;
+	size_t chunk, n;
+
+	if (!init) {
+		log_init();
+		g_log_level = LVL_ERROR;
+		init = true;
+	}
+	if (!size)
+		return 0;
+	dev_init(&dev, "fuzz", 0, 0);
+	dev.nkro = data[0] & 0x01;
+	g_coalesce = data[0] & 0x02;
+	dev.in_binary = data[0] & 0x04;
+	dev.bin.dev = &dev;
+	chunk = (data[0] >> 3) + 1;
+
+	for (size_t off = 1; off < size; off += n) {
+		n = size - off < chunk ? size - off : chunk;
+		input_process(&dev, (const char *)data + off, n);
+	}
+	esc_expire(&dev, &dev.esc);
+	keys_flush(&dev);
+	if (!dev.in_binary && (dev.num_keys_pressed || dev.modifier_keys || dev.batch_len))
+		abort();
+	return 0;
+}
+#endif
+
+#ifndef UHID_KBD_LIB
+/* Parse a --device spec: NAME[,vid=ID][,pid=ID][,nkro][,pointer][,input=PATH|-] */
+static struct uhid_dev *dev_parse(const char *spec)
+{
+	char buf[256], *tok, *save;
+	struct uhid_dev *dev;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	tok = strtok_r(buf, ",", &save);
+	if (!tok) {
+		log_error("Empty --device spec\n");
+		return NULL;
+	}
+	dev = dev_new(tok, create_ev.u.create.vendor, create_ev.u.create.product);
+	if (!dev)
+		return NULL;
+
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		if (!strncmp(tok, "vid=", 4)) {
+			dev->vendor = strtoul(tok + 4, NULL, 16);
+		} else if (!strncmp(tok, "pid=", 4)) {
+			dev->product = strtoul(tok + 4, NULL, 16);
+		} else if (!strcmp(tok, "nkro")) {
+			dev->nkro = true;
+		} else if (!strcmp(tok, "pointer")) {
+			dev->pointer = true;
+		} else if (!strncmp(tok, "input=", 6)) {
+			dev->in_path = strdup(tok + 6);
+		} else {
+			log_error("Unknown --device option: %s\n", tok);
+			return NULL;
+		}
+	}
+	return dev;
+}
+#endif
+
+/*
+ * Library interface, see uhid-kbd.h
+ * A struct uhid_kbd is the storage of one struct uhid_dev that never joins
+ * devs[] or the epoll set: the caller polls its fd, and reports take the
+ * same path as the program's own minus pacing, so nothing in here
+ * allocates. With -DUHID_KBD_LIB main() is left out, and so is whatever
+ * only the program uses: its inputs, control sockets, metrics export,
+ * macros, held keys, --nonblock, the writer thread and io_uring.
+ */
+_Static_assert(sizeof(struct uhid_dev) <= sizeof(struct uhid_kbd) &&
+	       _Alignof(struct uhid_dev) <= _Alignof(struct uhid_kbd),
+	       "struct uhid_kbd must hold a struct uhid_dev");
+
+static inline struct uhid_dev *kbd_dev(const struct uhid_kbd *kbd)
+{
+	return (struct uhid_dev *)kbd->opaque;
+}
+
+static pthread_once_t kbd_once = PTHREAD_ONCE_INIT;
+
+/* The program's defaults, but without per-report debug output */
+static void kbd_setup(void)
+{
+	const char *env_level = getenv("UHID_LOG_LEVEL");
+
+	log_init();
+	g_log_level = LVL_WARN;
+	if (env_level && log_level_from_str(env_level) >= 0)
+		g_log_level = log_level_from_str(env_level);
+}
+
+int uhid_kbd_open(struct uhid_kbd *kbd, const char *path, const char *name,
+		  uint32_t vendor, uint32_t product, unsigned int flags)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+
+	pthread_once(&kbd_once, kbd_setup);
+	dev_init(dev, name ? name : (const char *)create_ev.u.create.name, vendor, product);
+	dev->nkro = flags & UHID_KBD_NKRO;
+	dev->pointer = flags & UHID_KBD_POINTER;
+	return dev_open(dev, path ? path : "/dev/uhid", 0);
+}
+
+void uhid_kbd_close(struct uhid_kbd *kbd)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+
+	if (dev->fd < 0)
+		return;
+	uhid_kbd_flush(kbd);
+	dev_close(dev);
+	log_drain();
+}
+
+int uhid_kbd_fd(const struct uhid_kbd *kbd)
+{
+	return kbd_dev(kbd)->fd;
+}
+
+int uhid_kbd_dispatch(struct uhid_kbd *kbd)
+{
+	int ret = event(kbd_dev(kbd));
+
+	if (log_pending())
+		log_drain();
+	return ret;
+}
+
+int uhid_kbd_started(const struct uhid_kbd *kbd)
+{
+	return kbd_dev(kbd)->started;
+}
+
+int uhid_kbd_leds(const struct uhid_kbd *kbd)
+{
+	return kbd_dev(kbd)->leds_known ? kbd_dev(kbd)->leds : -1;
+}
+
+int uhid_kbd_press(struct uhid_kbd *kbd, uint8_t usage, uint8_t mods)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+
+	dev->modifier_keys |= mods;
+	if (usage)
+		add_key(dev, usage);
+	return send_event(dev, 0);
+}
+
+int uhid_kbd_release(struct uhid_kbd *kbd, uint8_t usage, uint8_t mods)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+
+	dev->modifier_keys &= ~mods;
+	if (usage)
+		remove_key(dev, usage);
+	return send_event(dev, 0);
+}
+
+int uhid_kbd_type(struct uhid_kbd *kbd, const char *text, size_t len)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+
+	return translate(dev, &dev->esc, text, len);
+}
+
+int uhid_kbd_consumer(struct uhid_kbd *kbd, uint16_t usage)
+{
+	if (usage > CONSUMER_USAGE_MAX)
+		return -EINVAL;
+	return send_consumer_event(kbd_dev(kbd), usage, 0);
+}
+
+int uhid_kbd_move(struct uhid_kbd *kbd, int dx, int dy, int wheel, int pan)
+{
+	const int d[4] = { dx, dy, wheel, pan };
+
+	if (!kbd_dev(kbd)->pointer)
+		return -EOPNOTSUPP;
+	for (int a = 0; a < 4; a++) {
+		/* abs(INT_MIN) is undefined */
+		if (d[a] < -POINTER_MOVE_MAX || d[a] > POINTER_MOVE_MAX)
+			return -ERANGE;
+	}
+	return pointer_move(kbd_dev(kbd), d);
+}
+
+int uhid_kbd_moveto(struct uhid_kbd *kbd, unsigned int x, unsigned int y)
+{
+	if (!kbd_dev(kbd)->pointer)
+		return -EOPNOTSUPP;
+	if (x > POINTER_ABS_MAX || y > POINTER_ABS_MAX)
+		return -ERANGE;
+	return pointer_moveto(kbd_dev(kbd), x, y);
+}
+
+int uhid_kbd_button(struct uhid_kbd *kbd, uint8_t mask, int down)
+{
+	if (!kbd_dev(kbd)->pointer)
+		return -EOPNOTSUPP;
+	return pointer_button(kbd_dev(kbd), mask & 0x1f, down, 0);
+}
+
+int uhid_kbd_flush(struct uhid_kbd *kbd)
+{
+	struct uhid_dev *dev = kbd_dev(kbd);
+	int ret, err;
+
+	ret = esc_expire(dev, &dev->esc);
+	err = pointer_sync(dev);
+	ret = ret ? : err;
+	err = keys_flush(dev);
+	ret = ret ? : err;
+	if (log_pending())
+		log_drain();
+	return ret;
+}
+
+#ifndef UHID_KBD_LIB
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [/dev/uhid]\n"
+		"  -h, --help            show this help\n"
+		"  -i, --input=FILE      type the contents of FILE and exit; stdin that\n"
+		"                        is not a tty is streamed the same way\n"
+		"  -d, --device=SPEC     create a device, may be repeated; SPEC is\n"
+		"                        NAME[,vid=HEX][,pid=HEX][,nkro][,pointer]\n"
+		"                        [,input=PATH|-].\n"
+		"                        --input or stdin feeds the first device without\n"
+		"                        input=\n"
+		"      --nkro            give every device an N-key rollover report\n"
+		"      --pointer         give every device a mouse and an absolute pointer\n"
+		"      --macros=FILE     load macros, played by the macro command or\n"
+		"                        their escape sequence key\n"
+		"      --layout=FILE     type for the host layout FILE describes (lines of\n"
+		"                        CHAR [MOD+]KEY [[MOD+]DEADKEY]) instead of US\n"
+		"      --coalesce        press runs of distinct keys with the same\n"
+		"                        modifiers together, one report per chord\n"
+		"      --no-dedup        also send reports identical to the previous one\n"
+		"      --daemon          keep the devices up for --listen or systemd socket\n"
+		"                        clients only, implies --wait-open\n"
+		"      --connect=ADDR    send the input to a running instance listening\n"
+		"                        on ADDR instead of creating a device; --device\n"
+		"                        NAME picks one of its devices\n"
+		"      --wait-open[=MS]  queue reports until the input device is opened,\n"
+		"                        at most MS (default 2000) ms\n"
+		"  -l, --listen=ADDR     take commands (type, key, hold, release, consumer,\n"
+		"                        macro, move, moveto, click, button, resend,\n"
+		"                        leds, dev) on unix:PATH,\n"
+		"                        tcp:[HOST:]PORT or udp:[HOST:]PORT (HOST\n"
+		"                        defaults to loopback, 0.0.0.0 for any); may\n"
+		"                        be repeated; append ,binary for records\n"
+		"      --binary          read device inputs as 10-byte binary records\n"
+		"                        {report id, mods, usages[6], hold ms (le16)}\n"
+		"      --rate=HZ         send at most HZ reports per second\n"
+		"      --hold=MS         keep each key pressed for MS milliseconds\n"
+		"      --esc-timeout=MS  time a lone ESC waits for the rest of an escape\n"
+		"                        sequence (default 50, 0 = end of each read)\n"
+		"      --nonblock[=POLICY]\n"
+		"                        never wait for the kernel to take a report but\n"
+		"                        queue it; POLICY for a full queue is block\n"
+		"                        (default), drop-oldest or coalesce\n"
+		"      --writer-thread[=CPU]\n"
+		"                        write reports from a separate thread, pinned\n"
+		"                        to CPU if given\n"
+		"      --metrics=ADDR    serve counters and latency histograms in the\n"
+		"                        Prometheus text format on unix:PATH or, over\n"
+		"                        HTTP, tcp:[HOST:]PORT; SIGUSR1 dumps them to\n"
+		"                        stderr\n"
+		"      --record=FILE     log every report written, with its time, to FILE\n"
+		"      --replay=FILE     send the reports of a --record FILE again\n"
+		"      --replay-speed=X  replay X times as fast (default 1, 0 for no delays)\n"
+		"      --bench[=COUNT]   inject COUNT (default 100000) synthetic characters\n"
+		"                        into the first device and report throughput and\n"
+		"                        write latency\n"
+		"      --bench-text=STR  characters to cycle through (default a-z)\n"
+		"      --bench-evdev     also time each key until it arrives on evdev\n"
+		"      --microbench[=MB] time the translation of plain, escape-heavy and\n"
+		"                        shifted text and of an MB (default 8) MB paste,\n"
+		"                        without creating a device\n"
+		"\n"
+		"Environment: UHID_VERBOSE, UHID_LOG_LEVEL, UHID_LOG_RATE, UHID_BATCH\n",
+		prog);
+}
+
+/* Open, create and register every device with the epoll set */
+static int devs_setup(const char *path)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct uhid_dev *dev;
+	int ret;
+
+	for (int i = 0; i < n_devs; i++) {
+		dev = devs[i];
+		ret = dev_open(dev, path, g_nonblock ? O_NONBLOCK : 0);
+		if (ret)
+			return ret;
+		dev->start_deadline = now_ns() + START_TIMEOUT_MS * 1000000ull;
+		if (g_nonblock) {
+			dev->out_q = calloc(OUT_MAX, sizeof(*dev->out_q));
+			if (!dev->out_q) {
+				log_error("Cannot allocate outbound queue: %m\n");
+				return -ENOMEM;
+			}
+		}
+		if (g_pacing) {
+			ret = sched_init(dev);
+			if (ret)
+				return ret;
+		}
+		dev->held = g_wait_open_ns != 0;
+
+		ev.data.u64 = EP_TAG(i, SRC_UHID);
+		if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, dev->fd, &ev))
+			return -errno;
+		if (dev->sched_tfd >= 0) {
+			ev.data.u64 = EP_TAG(i, SRC_TIMER);
+			if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, dev->sched_tfd, &ev))
+				return -errno;
+		}
+	}
+	return 0;
+}
+
+/* Input that ended still has to wait for its paced reports and motion */
+static bool devs_done(void)
+{
+	for (int i = 0; i < n_devs; i++) {
+		if ((devs[i]->in_fd >= 0 && !devs[i]->in_done) || sched_len(devs[i]) ||
+		    out_len(devs[i]) || devs[i]->frame_ns)
+			return false;
+	}
+	return true;
+}
+
+/* Fold @ms into the epoll timeout @timeout, -1 meaning none */
+static inline int min_timeout(int timeout, int ms)
+{
+	if (ms < 0)
+		return timeout;
+	return timeout < 0 || ms < timeout ? ms : timeout;
+}
+
+#ifdef UHID_IO_URING
+/* What the ring reads into, registered right after each struct uhid_dev */
+struct uring_buf {
+	struct uhid_event ev;
+	char in[INPUT_BUF_SIZE];
+} __attribute__((aligned(64)));	/* aligned_alloc() takes whole multiples */
+
+static struct uring_buf *uring_bufs;
+
+/* Drain the writes in flight and tear the ring down, reads are cancelled */
+static void uring_exit(void)
+{
+	for (int i = 0; g_ring.fd >= 0 && i < n_devs; i++) {
+		if (devs[i]->ring)
+			uring_wait_writes(devs[i]);
+		devs[i]->ring = false;
+	}
+	if (g_ring.sqes)
+		munmap(g_ring.sqes, g_ring.sqes_len);
+	if (g_ring.cq_ring && g_ring.cq_ring != g_ring.sq_ring)
+		munmap(g_ring.cq_ring, g_ring.cq_ring_len);
+	if (g_ring.sq_ring)
+		munmap(g_ring.sq_ring, g_ring.sq_ring_len);
+	if (g_ring.fd >= 0)
+		close(g_ring.fd);
+	free(uring_bufs);
+	uring_bufs = NULL;
+	g_ring = (struct uring){ .fd = -1 };
+}
+
+/* Set up the ring and move all devices over to it */
+static int uring_init(void)
+{
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = 4 * URING_ENTRIES,
+	};
+	struct iovec iov[2 * MAX_DEVICES];
+	void *ptr;
+	int ret;
+
+	g_ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (g_ring.fd < 0)
+		return -errno;
+
+	g_ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(__u32);
+	g_ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (g_ring.cq_ring_len > g_ring.sq_ring_len)
+			g_ring.sq_ring_len = g_ring.cq_ring_len;
+		g_ring.cq_ring_len = g_ring.sq_ring_len;
+	}
+	ptr = mmap(NULL, g_ring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   g_ring.fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	g_ring.sq_ring = ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ptr = mmap(NULL, g_ring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   g_ring.fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+	}
+	g_ring.cq_ring = ptr;
+	g_ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, g_ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		   g_ring.fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	g_ring.sqes = ptr;
+
+	g_ring.sq_head = (unsigned int *)((char *)g_ring.sq_ring + p.sq_off.head);
+	g_ring.sq_tail = (unsigned int *)((char *)g_ring.sq_ring + p.sq_off.tail);
+	g_ring.sq_mask = (unsigned int *)((char *)g_ring.sq_ring + p.sq_off.ring_mask);
+	g_ring.sq_array = (unsigned int *)((char *)g_ring.sq_ring + p.sq_off.array);
+	g_ring.cq_head = (unsigned int *)((char *)g_ring.cq_ring + p.cq_off.head);
+	g_ring.cq_tail = (unsigned int *)((char *)g_ring.cq_ring + p.cq_off.tail);
+	g_ring.cq_mask = (unsigned int *)((char *)g_ring.cq_ring + p.cq_off.ring_mask);
+	g_ring.cqes = (struct io_uring_cqe *)((char *)g_ring.cq_ring + p.cq_off.cqes);
+	g_ring.sq_entries = p.sq_entries;
+	g_ring.cq_entries = p.cq_entries;
+
+	uring_bufs = aligned_alloc(64, n_devs * sizeof(*uring_bufs));
+	if (!uring_bufs)
+		goto fail;
+	for (int i = 0; i < n_devs; i++) {
+		iov[2 * i] = (struct iovec){ devs[i], sizeof(*devs[i]) };
+		iov[2 * i + 1] = (struct iovec){ &uring_bufs[i], sizeof(*uring_bufs) };
+	}
+	if (syscall(__NR_io_uring_register, g_ring.fd, IORING_REGISTER_BUFFERS, iov, 2 * n_devs))
+		goto fail;
+
+	for (int i = 0; i < n_devs; i++) {
+		devs[i]->ring = true;
+		devs[i]->ring_idx = i;
+		epoll_ctl(g_epfd, EPOLL_CTL_DEL, devs[i]->fd, NULL);
+	}
+	return 0;
+
+fail:
+	ret = -errno;
+	uring_exit();
+	return ret;
+}
+
+/* A completion result in read() terms */
+static inline ssize_t uring_res(int res)
+{
+	if (res >= 0)
+		return res;
+	errno = -res;
+	return -1;
+}
+
+/*
+ * The io_uring counterpart of epoll_wait() in run(): keep the reads of
+ * every device in flight, submit them together with all queued writes,
+ * wait up to @timeout ms and handle the reads that completed. Returns the
+ * number of epoll events in @evs, or a negative error.
+ */
+static int uring_poll(struct epoll_event *evs, int max, int timeout)
+{
+	static struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct uhid_dev *dev;
+	int ret;
+
+	for (int i = 0; i < n_devs; i++) {
+		dev = devs[i];
+		if (!dev->uhid_reading && !dev->uhid_read_done) {
+			sqe = uring_sqe();
+			if (!sqe)
+				return -EIO;
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->fd = dev->fd;
+			sqe->addr = (uintptr_t)&uring_bufs[i].ev;
+			sqe->len = sizeof(uring_bufs[i].ev);
+			sqe->buf_index = 2 * i + 1;
+			sqe->user_data = URING_TAG(0, i, URING_UHID_READ);
+			dev->uhid_reading = true;
+		}
+		if (!dev->in_eager && !dev->in_reading && !dev->in_read_done && input_ready(dev)) {
+			sqe = uring_sqe();
+			if (!sqe)
+				return -EIO;
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->fd = dev->in_fd;
+			sqe->off = -1;	/* current position, pipes and ttys have none */
+			sqe->addr = (uintptr_t)uring_bufs[i].in;
+			sqe->len = input_chunk(dev);
+			sqe->buf_index = 2 * i + 1;
+			sqe->user_data = URING_TAG(0, i, URING_INPUT_READ);
+			dev->in_reading = true;
+		}
+	}
+	if (!g_ring.polling) {
+		sqe = uring_sqe();
+		if (!sqe)
+			return -EIO;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = g_epfd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_TAG(0, 0, URING_POLL);
+		g_ring.polling = true;
+	}
+	/* Completes on its own as soon as anything else does */
+	if (timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000ll;
+		sqe = uring_sqe();
+		if (!sqe)
+			return -EIO;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = URING_TAG(0, 0, URING_TIMEOUT);
+	}
+
+	ret = uring_submit(timeout != 0);
+	if (ret)
+		return ret;
+	uring_reap();
+
+	for (int i = 0; i < n_devs; i++) {
+		dev = devs[i];
+		if (dev->uhid_read_done) {
+			dev->uhid_read_done = false;
+			ret = event_process(dev, &uring_bufs[i].ev, uring_res(dev->uhid_read_res));
+			if (ret)
+				return ret;
+		}
+		if (dev->in_read_done) {
+			dev->in_read_done = false;
+			ret = input_consume(dev, uring_bufs[i].in, uring_res(dev->in_read_res));
+			if (ret > 0)
+				input_finish(dev);
+			else if (ret)
+				return ret;
+		}
+		if (!dev->ring_writes && dev->ring_err) {
+			ret = dev->ring_err;
+			dev->ring_err = 0;
+			return ret;
+		}
+	}
+
+	if (!g_ring.poll_done)
+		return 0;
+	g_ring.poll_done = false;
+	ret = epoll_wait(g_epfd, evs, max, 0);
+	if (ret < 0 && errno != EINTR) {
+		log_error("Cannot poll for fds: %m\n");
+		return -errno;
+	}
+	return ret < 0 ? 0 : ret;
+}
+#else
+static inline void uring_exit(void)
+{
+}
+#endif
+
+/* Serve every device until all input is consumed */
+static int run(void)
+{
+	struct epoll_event evs[64];
+	struct uhid_dev *dev;
+	int n, ret, timeout;
+	bool busy;
+	uint64_t now;
+
+#ifdef UHID_IO_URING
+	/* Reads on a non-blocking fd would complete right away, over and over */
+	ret = g_nonblock ? -EAGAIN : uring_init();
+	if (ret && g_nonblock)
+		log_info("Not using io_uring with --nonblock\n");
+	else if (ret)
+		log_warn("Cannot set up io_uring (%s), using epoll\n", strerror(-ret));
+#endif
+	/* A control socket or a held key keeps the devices up after all input ended */
+	while (n_listeners || ctl_clients() || g_wheel.n || replay_busy() || !devs_done()) {
+		busy = false;
+		timeout = -1;
+		now = now_ns();
+		for (int i = 0; i < n_devs; i++) {
+			dev = devs[i];
+			ret = input_update(dev, i);
+			if (ret)
+				return ret;
+			if (dev->in_eager && input_ready(dev)) {
+				ret = input_feed(dev);
+				if (ret > 0)
+					input_finish(dev);
+				else if (ret)
+					return ret;
+				busy = true;
+			}
+			if (dev->in_fd >= 0 && !dev->in_done && dev->in_bulk && !dev->started) {
+				if (now >= dev->start_deadline) {
+					log_error("No UHID_START for %s within %d ms\n",
+						  dev->name, START_TIMEOUT_MS);
+					return -ETIMEDOUT;
+				}
+				timeout = min_timeout(timeout, (dev->start_deadline - now) / 1000000 + 1);
+			}
+			timeout = min_timeout(timeout, esc_poll_timeout(dev, &dev->esc));
+			timeout = min_timeout(timeout, pointer_poll_timeout(dev));
+		}
+		if (g_replay.map && !g_replay.start_ns) {
+			ret = replay_start(now);
+			if (ret)
+				return ret;
+			if (!g_replay.start_ns)
+				timeout = min_timeout(timeout,
+						      (g_replay.start_deadline - now) / 1000000 + 1);
+		}
+
+		/* Diagnostics are only written out once there is nothing else to do */
+		if (busy || log_pending())
+			timeout = 0;
+#ifdef UHID_IO_URING
+		if (g_ring.fd >= 0) {
+			n = uring_poll(evs, ARRAY_SIZE(evs), timeout);
+			if (n < 0)
+				return n;
+		} else
+#endif
+		n = epoll_wait(g_epfd, evs, ARRAY_SIZE(evs), timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("Cannot poll for fds: %m\n");
+			return -errno;
+		} else if (n == 0 && !busy) {
+			log_drain();
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint32_t events = evs[i].events;
+			int idx = evs[i].data.u64 >> 8;
+
+			dev = idx < n_devs ? devs[idx] : NULL;
+			switch (evs[i].data.u64 & 0xff) {
+			case SRC_UHID:
+				if (events & EPOLLOUT) {
+					ret = out_drain(dev);
+					if (ret)
+						return ret;
+				}
+				if (events & EPOLLIN) {
+					ret = event(dev);
+					if (ret)
+						return ret;
+				} else if (events & (EPOLLHUP | EPOLLERR)) {
+					log_error("Received HUP on uhid-cdev of %s\n", dev->name);
+					return -EFAULT;
+				}
+				break;
+			case SRC_INPUT:
+				/* May have been dropped by an earlier event of this batch */
+				if (!dev->in_polled)
+					break;
+				if (events & EPOLLIN) {
+					ret = keyboard(dev);
+					if (ret > 0)
+						input_finish(dev);
+					else if (ret)
+						return ret;
+				} else if (events & (EPOLLHUP | EPOLLERR)) {
+					/* A pipe reports EPOLLHUP while data is still buffered in it */
+					log_info("Received HUP on input of %s\n", dev->name);
+					input_finish(dev);
+				}
+				break;
+			case SRC_TIMER:
+				ret = sched_run(dev);
+				if (ret)
+					return ret;
+				break;
+			case SRC_LISTEN:
+				if (listeners[idx].dgram)
+					ctl_recv_dgrams(&listeners[idx]);
+				else
+					ctl_accept(&listeners[idx]);
+				break;
+			case SRC_CLIENT:
+				if (!clients[idx])
+					break;
+				if (events & EPOLLIN)
+					ctl_read(idx);
+				else if (events & (EPOLLHUP | EPOLLERR))
+					ctl_close(idx);
+				break;
+			case SRC_METRICS:
+				metrics_accept();
+				break;
+			case SRC_METRICS_CLIENT:
+				if (metrics_conns[idx].fd >= 0)
+					metrics_read(idx);
+				break;
+			case SRC_SIGNAL:
+				metrics_signal();
+				break;
+			case SRC_WHEEL:
+				ret = wheel_run();
+				if (ret)
+					return ret;
+				break;
+			case SRC_REPLAY:
+				ret = replay_run();
+				if (ret)
+					return ret;
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "/dev/uhid";
+	const char *input_path = NULL;
+	const char *listen_specs[CTL_MAX_LISTEN];
+	int n_listen_specs = 0;
+	const char *macro_path = NULL;
+	const char *layout_path = NULL;
+	const char *connect_spec = NULL;
+	const char *metrics_spec = NULL;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	bool tty = false, stdin_taken = false, nkro = false, pointer = false, daemon = false, named;
+	int ret;
+	struct termios state;
+
+	log_init();
+
+	enum { OPT_BENCH = 0x100, OPT_BENCH_TEXT, OPT_BENCH_EVDEV, OPT_RATE, OPT_HOLD,
+	       OPT_ESC_TIMEOUT, OPT_BINARY, OPT_NKRO, OPT_POINTER,
+	       OPT_COALESCE, OPT_MACROS, OPT_WRITER_THREAD, OPT_NO_DEDUP,
+	       OPT_DAEMON, OPT_CONNECT, OPT_WAIT_OPEN, OPT_NONBLOCK, OPT_METRICS,
+	       OPT_LAYOUT, OPT_RECORD, OPT_REPLAY, OPT_REPLAY_SPEED, OPT_MICROBENCH };
+	static const struct option long_opts[] = {
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "bench",       optional_argument, NULL, OPT_BENCH },
+		{ "bench-text",  required_argument, NULL, OPT_BENCH_TEXT },
+		{ "bench-evdev", no_argument,       NULL, OPT_BENCH_EVDEV },
+		{ "microbench",  optional_argument, NULL, OPT_MICROBENCH },
+		{ "input",       required_argument, NULL, 'i' },
+		{ "device",      required_argument, NULL, 'd' },
+		{ "listen",      required_argument, NULL, 'l' },
+		{ "daemon",      no_argument,       NULL, OPT_DAEMON },
+		{ "connect",     required_argument, NULL, OPT_CONNECT },
+		{ "wait-open",   optional_argument, NULL, OPT_WAIT_OPEN },
+		{ "binary",      no_argument,       NULL, OPT_BINARY },
+		{ "nkro",        no_argument,       NULL, OPT_NKRO },
+		{ "pointer",     no_argument,       NULL, OPT_POINTER },
+		{ "coalesce",    no_argument,       NULL, OPT_COALESCE },
+		{ "no-dedup",    no_argument,       NULL, OPT_NO_DEDUP },
+		{ "macros",      required_argument, NULL, OPT_MACROS },
+		{ "layout",      required_argument, NULL, OPT_LAYOUT },
+		{ "rate",        required_argument, NULL, OPT_RATE },
+		{ "hold",        required_argument, NULL, OPT_HOLD },
+		{ "esc-timeout", required_argument, NULL, OPT_ESC_TIMEOUT },
+		{ "writer-thread", optional_argument, NULL, OPT_WRITER_THREAD },
+		{ "nonblock",    optional_argument, NULL, OPT_NONBLOCK },
+		{ "metrics",     required_argument, NULL, OPT_METRICS },
+		{ "record",      required_argument, NULL, OPT_RECORD },
+		{ "replay",      required_argument, NULL, OPT_REPLAY },
+		{ "replay-speed", required_argument, NULL, OPT_REPLAY_SPEED },
+		{ NULL, 0, NULL, 0 },
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hi:d:l:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case OPT_BENCH:
+			g_bench_count = optarg ? strtoul(optarg, NULL, 0) : 100000;
+			break;
+		case OPT_BENCH_TEXT:
+			g_bench_text = optarg;
+			break;
+		case OPT_BENCH_EVDEV:
+			g_bench_evdev = true;
+			break;
+		case OPT_MICROBENCH:
+			g_microbench_mb = optarg ? strtoul(optarg, NULL, 0) : 8;
+			if (!g_microbench_mb) {
+				log_error("Bad --microbench size %s\n", optarg);
+				log_drain();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			input_path = optarg;
+			break;
+		case 'd':
+			if (!dev_parse(optarg)) {
+				log_drain();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			if (n_listen_specs < CTL_MAX_LISTEN)
+				listen_specs[n_listen_specs++] = optarg;
+			if (ctl_spec_binary(optarg))
+				g_binary_used = true;
+			break;
+		case OPT_DAEMON:
+			daemon = true;
+			break;
+		case OPT_CONNECT:
+			connect_spec = optarg;
+			break;
+		case OPT_WAIT_OPEN:
+			g_wait_open_ns = (optarg ? strtod(optarg, NULL) : START_TIMEOUT_MS) * 1e6;
+			break;
+		case OPT_BINARY:
+			g_binary = g_binary_used = true;
+			break;
+		case OPT_NKRO:
+			nkro = true;
+			break;
+		case OPT_POINTER:
+			pointer = true;
+			break;
+		case OPT_COALESCE:
+			g_coalesce = true;
+			break;
+		case OPT_NO_DEDUP:
+			g_dedup = false;
+			break;
+		case OPT_MACROS:
+			macro_path = optarg;
+			break;
+		case OPT_RATE: {
+			double hz = strtod(optarg, NULL);
+
+			g_rate_gap_ns = hz > 0 ? 1e9 / hz : 0;
 			break;
 		}
-		if (pfds[0].revents & POLLHUP) {
-			fprintf(stderr, "Received HUP on stdin\n");
+		case OPT_HOLD:
+			g_hold_ns = strtod(optarg, NULL) * 1e6;
+			break;
+		case OPT_ESC_TIMEOUT:
+			g_esc_timeout_ns = strtod(optarg, NULL) * 1e6;
+			break;
+		case OPT_LAYOUT:
+			layout_path = optarg;
+			break;
+		case OPT_METRICS:
+			metrics_spec = optarg;
+			break;
+		case OPT_RECORD:
+			record_path = optarg;
+			break;
+		case OPT_REPLAY:
+			replay_path = optarg;
+			break;
+		case OPT_REPLAY_SPEED: {
+			char *end;
+
+			g_replay.speed = strtod(optarg, &end);
+			if (*end || !(g_replay.speed >= 0)) {
+				log_error("Bad --replay-speed %s\n", optarg);
+				log_drain();
+				return EXIT_FAILURE;
+			}
 			break;
 		}
-		if (pfds[1].revents & POLLHUP) {
-			fprintf(stderr, "Received HUP on uhid-cdev\n");
+		case OPT_NONBLOCK:
+			g_nonblock = true;
+			if (!optarg || !strcmp(optarg, "block")) {
+				g_overflow = OVERFLOW_BLOCK;
+			} else if (!strcmp(optarg, "drop-oldest")) {
+				g_overflow = OVERFLOW_DROP_OLDEST;
+			} else if (!strcmp(optarg, "coalesce")) {
+				g_overflow = OVERFLOW_COALESCE;
+			} else {
+				log_error("Unknown --nonblock policy %s\n", optarg);
+				log_drain();
+				return EXIT_FAILURE;
+			}
 			break;
+		case OPT_WRITER_THREAD:
+			g_writer_thread = true;
+			if (optarg) {
+				char *end;
+
+				g_writer_cpu = strtol(optarg, &end, 0);
+				if (*end || g_writer_cpu < 0 || g_writer_cpu >= CPU_SETSIZE) {
+					log_error("Invalid --writer-thread CPU %s\n", optarg);
+					log_drain();
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
 		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+	if (g_nonblock && g_writer_thread) {
+		log_error("--nonblock and --writer-thread do not go together\n");
+		log_drain();
+		return EXIT_FAILURE;
+	}
 
-		if (pfds[0].revents & POLLIN) {
-			ret = keyboard(fd);
-			if (ret)
-				break;
+	named = n_devs > 0;
+	if (!n_devs && !dev_new((const char *)create_ev.u.create.name,
+				create_ev.u.create.vendor, create_ev.u.create.product))
+		return EXIT_FAILURE;
+
+	for (int i = 0; i < n_devs; i++) {
+		devs[i]->nkro |= nkro;
+		devs[i]->pointer |= pointer;
+	}
+
+	/* --input, or else stdin, goes to the first device without an input */
+	for (int i = 0; i < n_devs; i++) {
+		if (devs[i]->in_path && !strcmp(devs[i]->in_path, "-"))
+			stdin_taken = true;
+	}
+	/* A daemon only takes commands, a replay brings its own reports */
+	if ((daemon && !connect_spec) || replay_path)
+		stdin_taken = true;
+	for (int i = 0; i < n_devs && (input_path || !stdin_taken); i++) {
+		if (!devs[i]->in_path) {
+			devs[i]->in_path = strdup(input_path ? input_path : "-");
+			break;
 		}
-		if (pfds[1].revents & POLLIN) {
-			ret = event(fd);
+	}
+	for (int i = 0; i < n_devs; i++) {
+		if (devs[i]->in_path && input_open(devs[i])) {
+			log_drain();
+			return EXIT_FAILURE;
+		}
+		if (devs[i]->in_fd == STDIN_FILENO && !devs[i]->in_bulk)
+			tty = true;
+	}
+
+	if (!g_bench_count && tty) {
+		ret = tcgetattr(STDIN_FILENO, &state);
+		if (ret) {
+			log_warn("Cannot get tty state\n");
+		} else {
+			state.c_lflag &= ~ICANON;
+			state.c_cc[VMIN] = 1;
+			ret = tcsetattr(STDIN_FILENO, TCSANOW, &state);
 			if (ret)
-				break;
+				log_warn("Cannot set tty state\n");
+		}
+	}
+
+    const char *env_verbose = getenv("UHID_VERBOSE");
+    if (env_verbose && (!strcmp(env_verbose, "0") || !strcasecmp(env_verbose, "false")))
+        g_log_level = LVL_INFO;
+    /* Per-report debug output would dominate a benchmark */
+    if ((g_bench_count || g_microbench_mb) && g_log_level > LVL_INFO)
+        g_log_level = LVL_INFO;
+    const char *env_level = getenv("UHID_LOG_LEVEL");
+    if (env_level && log_level_from_str(env_level) >= 0)
+        g_log_level = log_level_from_str(env_level);
+    const char *env_rate = getenv("UHID_LOG_RATE");
+    if (env_rate)
+        g_log_rate = strtoul(env_rate, NULL, 0);
+    const char *env_batch = getenv("UHID_BATCH");
+    if (env_batch && (!strcmp(env_batch, "0") || !strcasecmp(env_batch, "false")))
+        g_batch = 0;
+
+    if (connect_spec) {
+        ret = client_run(connect_spec, devs[0], named ? devs[0]->name : NULL);
+        log_drain();
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    /* Nothing may get lost between starting up and the first reader */
+    if (daemon && !g_wait_open_ns)
+        g_wait_open_ns = START_TIMEOUT_MS * 1000000ull;
+    /* Macros are typed, so they need the layout first */
+    if (layout_path && layout_load(layout_path)) {
+        log_drain();
+        return EXIT_FAILURE;
+    }
+    if (macro_path && macro_load(macro_path)) {
+        log_drain();
+        return EXIT_FAILURE;
+    }
+    /* Before pacing is set up: sinks have no queue, only the translation counts */
+    if (g_microbench_mb) {
+        ret = microbench_run(nkro);
+        log_drain();
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    /* Binary holds and macro delays are timed by the pacing queue */
+    if (ctl_inherit_binary())
+        g_binary_used = true;
+    g_pacing = g_rate_gap_ns || g_hold_ns || g_binary_used || g_macro_gaps || g_wait_open_ns;
+
+    log_info("Open uhid-cdev %s for %d device(s)\n", path, n_devs);
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epfd < 0) {
+		log_error("Cannot create epoll instance: %m\n");
+		return EXIT_FAILURE;
+	}
+	/* Before any thread starts, so that they all inherit the blocked SIGUSR1 */
+	ret = metrics_signal_setup();
+	if (!ret)
+		ret = devs_setup(path);
+	for (int i = 0; !ret && i < n_listen_specs; i++)
+		ret = ctl_listen(listen_specs[i]);
+	if (!ret)
+		ret = ctl_inherit();
+	if (!ret && daemon && !n_listeners && !ctl_clients()) {
+		log_error("--daemon needs --listen or sockets from systemd\n");
+		ret = -EINVAL;
+	}
+	if (!ret && metrics_spec)
+		ret = metrics_listen(metrics_spec);
+	if (!ret && record_path)
+		ret = trace_open(record_path);
+	if (!ret && replay_path)
+		ret = replay_open(replay_path);
+	if (!ret && g_writer_thread)
+		ret = writer_start();
+	if (!ret) {
+		if (g_bench_count) {
+			ret = bench_run(devs[0]);
+		} else {
+			log_info("Keyboard UHID device created. Type any characters to send as keyboard input.\n");
+			notify_ready();
+			ret = run();
 		}
 	}
 
-	fprintf(stderr, "Destroy uhid device\n");
-	destroy(fd);
-	return EXIT_SUCCESS;
+	for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (clients[i])
+			ctl_close(i);
+	}
+	for (int i = 0; i < n_listeners; i++) {
+		close(listeners[i].fd);
+		if (listeners[i].path[0])
+			unlink(listeners[i].path);
+	}
+	metrics_exit();
+	replay_close();
+	if (g_wheel.tfd >= 0)
+		close(g_wheel.tfd);
+	writer_stop();
+	uring_exit();
+	for (int i = 0; i < n_devs; i++) {
+		if (out_len(devs[i]) && out_wait(devs[i], 1000))
+			log_warn("Dropping %u queued reports for %s\n", out_len(devs[i]), devs[i]->name);
+		if (devs[i]->out_dropped)
+			log_warn("Overflow policy dropped %" PRIu64 " reports for %s\n",
+				 devs[i]->out_dropped, devs[i]->name);
+		if (devs[i]->dup_reports)
+			log_info("Suppressed %" PRIu64 " duplicate reports for %s\n",
+				 devs[i]->dup_reports, devs[i]->name);
+		dev_close(devs[i]);
+		dev_free(devs[i]);
+	}
+	trace_close();
+	close(g_epfd);
+	log_drain();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+#endif /* UHID_KBD_LIB */
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * uhid-kbd: the virtual keyboard of uhid-example.c as a library
+ *
+ * Build uhid-example.c with -DUHID_KBD_LIB to leave out the command line
+ * program and link the object into your own:
+ *   gcc -c -O2 -pthread -DUHID_KBD_LIB -o uhid-kbd.o uhid-example.c
+ *   gcc -pthread -o daemon daemon.c uhid-kbd.o
+ *
+ * A keyboard lives entirely in the struct uhid_kbd the caller provides,
+ * static, on the stack or embedded in its own structures; nothing is
+ * allocated after uhid_kbd_open(). Keys, text and consumer controls queue
+ * reports that uhid_kbd_flush() writes out with one writev(). The device
+ * only takes reports once the kernel started it: poll uhid_kbd_fd() for
+ * POLLIN, call uhid_kbd_dispatch() whenever it is readable and wait for
+ * uhid_kbd_started() before sending anything.
+ *
+ * Calls on one keyboard must not overlap; different keyboards may be used
+ * from different threads. All functions that can fail return 0 or a
+ * negative errno. --layout, --coalesce, pacing and the other options of the
+ * program are not available here, the library always types US QWERTY
+ * straight through.
+ */
+#ifndef UHID_KBD_H
+#define UHID_KBD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UHID_KBD_STORAGE	32768
+
+struct uhid_kbd {
+	unsigned char opaque[UHID_KBD_STORAGE];
+} __attribute__((aligned(64)));
+
+/* uhid_kbd_open() flags */
+#define UHID_KBD_NKRO		0x1	/* N-key rollover bitmap instead of 6 keys */
+#define UHID_KBD_POINTER	0x2	/* a mouse and an absolute pointer too */
+
+/* Modifier bits of uhid_kbd_press() and uhid_kbd_release() */
+#define UHID_KBD_MOD_LCTRL	0x01
+#define UHID_KBD_MOD_LSHIFT	0x02
+#define UHID_KBD_MOD_LALT	0x04
+#define UHID_KBD_MOD_LGUI	0x08
+#define UHID_KBD_MOD_RCTRL	0x10
+#define UHID_KBD_MOD_RSHIFT	0x20
+#define UHID_KBD_MOD_RALT	0x40
+#define UHID_KBD_MOD_RGUI	0x80
+
+/*
+ * Create a keyboard on @path (NULL: /dev/uhid) called @name (NULL: the
+ * program's default) with USB IDs @vendor:@product
+ */
+int uhid_kbd_open(struct uhid_kbd *kbd, const char *path, const char *name,
+		  uint32_t vendor, uint32_t product, unsigned int flags);
+/* Destroy the device; pending reports are written out first */
+void uhid_kbd_close(struct uhid_kbd *kbd);
+
+/* The uhid fd, readable when uhid_kbd_dispatch() has work */
+int uhid_kbd_fd(const struct uhid_kbd *kbd);
+/* Handle one event from the kernel */
+int uhid_kbd_dispatch(struct uhid_kbd *kbd);
+/* Whether the kernel started the device, i.e. takes reports */
+int uhid_kbd_started(const struct uhid_kbd *kbd);
+/* The LED_* bits the host set, -1 until it did */
+int uhid_kbd_leds(const struct uhid_kbd *kbd);
+
+/* Press or release the HID keyboard usage @usage together with @mods */
+int uhid_kbd_press(struct uhid_kbd *kbd, uint8_t usage, uint8_t mods);
+int uhid_kbd_release(struct uhid_kbd *kbd, uint8_t usage, uint8_t mods);
+/*
+ * Type @len bytes of UTF-8 text with terminal escape sequences, as the
+ * program does with its input; a sequence may continue into the next call
+ */
+int uhid_kbd_type(struct uhid_kbd *kbd, const char *text, size_t len);
+/* Hold down consumer control @usage, 0 for none */
+int uhid_kbd_consumer(struct uhid_kbd *kbd, uint16_t usage);
+/*
+ * With UHID_KBD_POINTER: move by @dx, @dy and scroll by @wheel, @pan, or
+ * put the absolute pointer at @x, @y out of 0-32767; motion adds up or is
+ * replaced until the next button change or flush sends it
+ */
+int uhid_kbd_move(struct uhid_kbd *kbd, int dx, int dy, int wheel, int pan);
+int uhid_kbd_moveto(struct uhid_kbd *kbd, unsigned int x, unsigned int y);
+/* Press or release the mouse buttons @mask, bit 0 left to bit 4 forward */
+int uhid_kbd_button(struct uhid_kbd *kbd, uint8_t mask, int down);
+
+/* End a pending escape sequence and write out all queued reports */
+int uhid_kbd_flush(struct uhid_kbd *kbd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif